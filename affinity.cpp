@@ -0,0 +1,152 @@
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool cpu_list_parse(const std::string &s, cpu_list &out) {
+    cpu_list cpus;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream is(item);
+        if (!(is >> first))
+            return false;
+        last = first;
+        if (is >> dash && (dash != '-' || !(is >> last)))
+            return false;
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    out = cpus;
+    return true;
+}
+
+std::string cpu_list_str(const cpu_list &cpus) {
+    std::stringstream ss;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            ++j;
+        ss << (i ? "," : "") << cpus[i];
+        if (j > i)
+            ss << "-" << cpus[j];
+        i = j + 1;
+    }
+    return cpus.empty() ? "any" : ss.str();
+}
+
+int numa_nodes() {
+    /* Same format as a cpu list, e.g. "0-1" */
+    std::ifstream f("/sys/devices/system/node/online");
+    std::string s;
+    cpu_list nodes;
+    if (!std::getline(f, s) || !cpu_list_parse(s, nodes) || nodes.empty())
+        return 1;
+    return nodes.back() + 1;
+}
+
+int numa_node_of_cpu(int cpu) {
+    for (int node = 0; node < numa_nodes(); ++node) {
+        /* Link to the node, if the cpu is on it */
+        std::ifstream f("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                        "/node" + std::to_string(node) + "/cpulist");
+        if (f.is_open())
+            return node;
+    }
+    return 0;
+}
+
+std::vector<long> numa_histogram(const void *addr, size_t len,
+                                 size_t stride) {
+    int nodes = numa_nodes();
+    std::vector<long> hist(nodes + 1);
+    std::vector<void *> pages;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += stride)
+        pages.push_back((void *)(((uintptr_t)addr + off) & ~(page - 1)));
+    std::vector<int> status(pages.size(), -1);
+    /* move_pages() without target nodes only reports where pages are */
+    if (!pages.empty() && syscall(SYS_move_pages, 0, pages.size(),
+                                  pages.data(), NULL, status.data(), 0))
+        std::fill(status.begin(), status.end(), -1);
+    for (int s : status)
+        hist[s >= 0 && s < nodes ? s : nodes]++;
+    return hist;
+}
+
+void thread_placement::apply() {
+    std::stringstream err;
+    outcome done;
+
+    if (!this->cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : this->cpus)
+            CPU_SET(cpu, &set);
+        if (int e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            err << " affinity: " << strerror(e);
+    }
+
+    if (this->numa && numa_nodes() > 1) {
+        int node = numa_node_of_cpu(this->cpus.empty() ? sched_getcpu()
+                                                       : this->cpus.front());
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+                    sizeof(mask) * 8))
+            err << " numa: " << strerror(errno);
+        else
+            done.node = node;
+    }
+
+    if (this->fifo > 0) {
+        struct sched_param param = {};
+        param.sched_priority = this->fifo;
+        if (int e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+            err << " fifo: " << strerror(e);
+        else
+            done.fifo = this->fifo;
+    }
+
+    done.error = err.str();
+    {
+        std::lock_guard<std::mutex> lk(this->guard);
+        this->result = done;
+    }
+    this->sample();
+}
+
+thread_placement::outcome thread_placement::applied() const {
+    std::lock_guard<std::mutex> lk(this->guard);
+    return this->result;
+}
+
+void thread_placement::sample() {
+    this->cpu.store(sched_getcpu(), std::memory_order_relaxed);
+}
+
+std::string thread_placement::str() const {
+    std::stringstream ss;
+    auto done = this->applied();
+    ss << this->role << " cpus=" << cpu_list_str(this->cpus)
+       << " on=" << this->cpu.load(std::memory_order_relaxed);
+    if (done.node >= 0)
+        ss << " node=" << done.node;
+    if (done.fifo)
+        ss << " fifo=" << done.fifo;
+    if (!done.error.empty())
+        ss << " (" << done.error.substr(1) << ")";
+    return ss.str();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Thread placement: CPU sets, the NUMA node memory is taken from and the
+ * scheduling class. All of it is best effort - a CPU that is not there, a
+ * single node machine or missing privileges for SCHED_FIFO leave the thread
+ * as it was, and the placement says so. */
+
+typedef std::vector<int> cpu_list;
+
+/* "0-3,8,10-11" to a list, false if malformed. Empty string is empty list */
+bool cpu_list_parse(const std::string &s, cpu_list &out);
+std::string cpu_list_str(const cpu_list &cpus);
+
+int numa_nodes();              /* Online nodes, 1 if unknown */
+int numa_node_of_cpu(int cpu); /* 0 if unknown */
+/* Count the pages at addr, addr + stride ... below addr + len by the node
+ * they are on. The last entry counts pages not faulted in (or unknown). */
+std::vector<long> numa_histogram(const void *addr, size_t len, size_t stride);
+
+struct thread_placement {
+    /* Requested */
+    std::string role;
+    cpu_list cpus;     /* Empty is any */
+    int fifo = 0;      /* SCHED_FIFO priority, 0 is the normal class */
+    bool numa = false; /* Prefer memory of the node of the first CPU */
+
+    /* Applied */
+    struct outcome {
+        int node = -1;     /* Memory preferred from, -1 is default policy */
+        int fifo = 0;      /* SCHED_FIFO priority it got, 0 if none */
+        std::string error; /* What did not apply */
+    };
+    std::atomic_int cpu{-1}; /* Last seen running on, see sample() */
+
+    /* Apply to the calling thread. With numa, what the thread touches first
+     * (its buffers, its allocations) lands on its node. */
+    void apply();
+    /* Record the CPU the calling thread runs on now */
+    void sample();
+
+    /* A copy of what apply() did, from any thread */
+    outcome applied() const;
+    std::string str() const;
+
+  private:
+    mutable std::mutex guard; /* Of result, set once per apply() */
+    outcome result;
+};
@@ -0,0 +1,114 @@
+#include "checkpoint.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Bytes of the sections the header counts, after it */
+static size_t sections_size(const checkpoint_header &h) {
+    return h.nconf * sizeof(checkpoint_conf) +
+           h.ngroups * sizeof(checkpoint_group) +
+           h.ncapuch * sizeof(checkpoint_capuch) +
+           h.nflushes * sizeof(checkpoint_flush) +
+           h.nbuffers * sizeof(checkpoint_buffer) +
+           h.nreserve * sizeof(int32_t);
+}
+
+bool checkpoint::write(const std::string &path, std::string &error) {
+    auto &h = this->head;
+    h.magic = checkpoint_header::magic_value;
+    h.version = checkpoint_header::version_value;
+    h.nconf = this->conf.size();
+    h.ngroups = this->groups.size();
+    h.ncapuch = this->capuches.size();
+    h.nflushes = this->flushes.size();
+    h.nbuffers = this->buffers.size();
+    h.nreserve = this->reserve.size();
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    auto put = [&](const void *data, size_t n) {
+        for (auto p = (const char *)data; ok && n;) {
+            ssize_t put = ::write(fd, p, n);
+            ok = put > 0;
+            p += put, n -= put;
+        }
+    };
+    put(&h, sizeof(h));
+    put(this->conf.data(), h.nconf * sizeof(checkpoint_conf));
+    put(this->groups.data(), h.ngroups * sizeof(checkpoint_group));
+    put(this->capuches.data(), h.ncapuch * sizeof(checkpoint_capuch));
+    put(this->flushes.data(), h.nflushes * sizeof(checkpoint_flush));
+    put(this->buffers.data(), h.nbuffers * sizeof(checkpoint_buffer));
+    put(this->reserve.data(), h.nreserve * sizeof(int32_t));
+    if (ok)
+        ok = !fsync(fd);
+    int err = errno;
+    if (fd >= 0)
+        close(fd);
+    if (ok && rename(tmp.c_str(), path.c_str())) {
+        ok = false;
+        err = errno;
+    }
+    if (!ok) {
+        error = path + ": " + strerror(err);
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+checkpoint_map::checkpoint_map(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        this->error = path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    this->size = st.st_size;
+    if (this->size >= sizeof(checkpoint_header)) {
+        void *addr = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            this->error = path + ": " + strerror(errno);
+        else
+            this->base = addr;
+    }
+    close(fd);
+    if (!this->base) {
+        if (this->error.empty())
+            this->error = path + ": not a checkpoint";
+        return;
+    }
+
+    auto h = (const checkpoint_header *)this->base;
+    if (h->magic != checkpoint_header::magic_value ||
+        h->version != checkpoint_header::version_value ||
+        sizeof(*h) + sections_size(*h) != this->size) {
+        this->error = path + ": not a checkpoint of this version";
+        return;
+    }
+    auto p = (const char *)(h + 1);
+    this->conf = (const checkpoint_conf *)p;
+    p += h->nconf * sizeof(checkpoint_conf);
+    this->groups = (const checkpoint_group *)p;
+    p += h->ngroups * sizeof(checkpoint_group);
+    this->capuches = (const checkpoint_capuch *)p;
+    p += h->ncapuch * sizeof(checkpoint_capuch);
+    this->flushes = (const checkpoint_flush *)p;
+    p += h->nflushes * sizeof(checkpoint_flush);
+    this->buffers = (const checkpoint_buffer *)p;
+    p += h->nbuffers * sizeof(checkpoint_buffer);
+    this->reserve = (const int32_t *)p;
+    this->head = h;
+}
+
+checkpoint_map::~checkpoint_map() {
+    if (this->base)
+        munmap(this->base, this->size);
+}
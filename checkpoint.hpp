@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Snapshot of a paused simulation, see simulation::save() and load(). A
+ * header, then fixed size entries section after section in the order
+ * below, so that a checkpoint is read in place from its mapping. Native
+ * byte order and alignment, for the machine that took it. Times are
+ * nanoseconds from the clock at the save. Buffer contents are not kept,
+ * only which buffer is where. */
+struct checkpoint_header {
+    static constexpr uint64_t magic_value = 0x74706b6375706163ULL;
+    static constexpr uint32_t version_value = 1;
+
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nconf, ngroups, ncapuch, nflushes, nbuffers, nreserve;
+    int64_t total_rsc, max_rsc;
+    int64_t disk_backlog_ns;
+    uint64_t disk_seq;
+    struct { /* Counters carried on */
+        uint64_t disk_ops, disk_stalls, locks_taken, bufs_lost;
+        uint64_t reserve_hits, reserve_misses, donations, donated;
+    } stats;
+};
+
+struct checkpoint_conf { /* Of simulation::conf_map */
+    char name[48];
+    int64_t value;
+};
+
+struct checkpoint_group { /* In index order, parents first */
+    char path[256];
+    int64_t weight;
+};
+
+struct checkpoint_capuch {
+    int32_t id, shard, tenant;
+    int32_t priority, ready_per_sec;
+    int32_t greed, batch_size, batch_id, borrowed;
+    int32_t active, active_batch_id; /* Buffer id, -1 if none */
+    int32_t nfree, nready, ndonated; /* Its buffers, in order */
+    int32_t nflushes;
+    int32_t flush_ready;
+    int32_t greed_inc, greed_dec, timeout;
+    uint64_t trace_rng, trace_seq;
+    double fill_per_sec, fill_gap, flush_sec, set_for; /* EWMA */
+    int64_t last_ready_ns, flush_finish_ns;
+};
+
+struct checkpoint_flush { /* A batch in flight */
+    int64_t batch_id;
+    int64_t start_ns, finish_ns;
+};
+
+struct checkpoint_buffer { /* Of a capuch's lists or mailbox */
+    int32_t id, batch_id;
+};
+
+/* A checkpoint being taken, written out in one go */
+struct checkpoint {
+    checkpoint_header head = {};
+    std::vector<checkpoint_conf> conf;
+    std::vector<checkpoint_group> groups;
+    std::vector<checkpoint_capuch> capuches;
+    std::vector<checkpoint_flush> flushes;
+    std::vector<checkpoint_buffer> buffers;
+    std::vector<int32_t> reserve; /* Ids, bottom of the stack first */
+
+    /* To path, replaced at once. False with error set if it could not. */
+    bool write(const std::string &path, std::string &error);
+};
+
+/* A checkpoint file mapped read only, its sections pointing into it */
+class checkpoint_map {
+  private:
+    void *base = nullptr;
+    size_t size = 0;
+    std::string error;
+
+  public:
+    const checkpoint_header *head = nullptr;
+    const checkpoint_conf *conf = nullptr;
+    const checkpoint_group *groups = nullptr;
+    const checkpoint_capuch *capuches = nullptr;
+    const checkpoint_flush *flushes = nullptr;
+    const checkpoint_buffer *buffers = nullptr;
+    const int32_t *reserve = nullptr;
+
+    /* Mapped and checked that the sections fit, see is_open() */
+    checkpoint_map(const std::string &path);
+    checkpoint_map(const checkpoint_map &) = delete;
+    ~checkpoint_map();
+
+    bool is_open() const { return this->head; }
+    const std::string &get_error() const { return this->error; }
+};
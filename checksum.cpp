@@ -0,0 +1,235 @@
+#include "checksum.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* crc32c */
+
+static constexpr uint32_t crc32c_poly = 0x82f63b78; /* Reflected */
+
+/* Three blocks of this size are crc'ed at once by the sse4.2 kernel, to hide
+ * the latency of the crc32 instruction */
+static constexpr size_t crc32c_block = 256;
+
+static struct crc32c_tables {
+    uint32_t t[8][256];
+    /* Advance a raw crc over crc32c_block zero bytes, by bytes of the crc */
+    uint32_t shift[4][256];
+    crc32c_tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? (c >> 1) ^ crc32c_poly : c >> 1;
+            this->t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k)
+                this->t[k][i] = (this->t[k - 1][i] >> 8) ^
+                                this->t[0][this->t[k - 1][i] & 0xff];
+
+        /* Zero bytes make the update linear in the crc: shift each bit, then
+         * any crc byte is the xor of its bits */
+        uint32_t bit[32];
+        for (int b = 0; b < 32; ++b) {
+            uint32_t c = 1U << b;
+            for (size_t n = 0; n < crc32c_block; ++n)
+                c = (c >> 8) ^ this->t[0][c & 0xff];
+            bit[b] = c;
+        }
+        for (int j = 0; j < 4; ++j)
+            for (uint32_t v = 0; v < 256; ++v) {
+                uint32_t c = 0;
+                for (int b = 0; b < 8; ++b)
+                    if (v & (1U << b))
+                        c ^= bit[8 * j + b];
+                this->shift[j][v] = c;
+            }
+    }
+
+    uint32_t shift_block(uint32_t c) const {
+        return this->shift[0][c & 0xff] ^ this->shift[1][(c >> 8) & 0xff] ^
+               this->shift[2][(c >> 16) & 0xff] ^ this->shift[3][c >> 24];
+    }
+} crc32c_tables;
+
+static uint32_t crc32c_scalar(const void *data, size_t n) {
+    auto p = (const uint8_t *)data;
+    auto &t = crc32c_tables.t;
+    uint32_t crc = 0xffffffff;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v = load64(p) ^ crc;
+        crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+              t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+              t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+              t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+    }
+    for (; n; --n, ++p)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+    return ~crc;
+}
+
+#if defined(__x86_64__) /* The 64 bit crc32 instruction */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(const void *data, size_t n) {
+    auto p = (const uint8_t *)data;
+    uint64_t crc = 0xffffffff;
+    /* crc(s, A|B|C) = shift(shift(crc(s, A)) ^ crc(0, B)) ^ crc(0, C) */
+    for (; n >= 3 * crc32c_block; n -= 3 * crc32c_block) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < crc32c_block; i += 8, p += 8) {
+            crc = _mm_crc32_u64(crc, load64(p));
+            c1 = _mm_crc32_u64(c1, load64(p + crc32c_block));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * crc32c_block));
+        }
+        p += 2 * crc32c_block;
+        crc = crc32c_tables.shift_block(crc32c_tables.shift_block(crc) ^ c1) ^
+              c2;
+    }
+    for (; n >= 8; n -= 8, p += 8)
+        crc = _mm_crc32_u64(crc, load64(p));
+    for (; n; --n, ++p)
+        crc = _mm_crc32_u8(crc, *p);
+    return ~crc;
+}
+#endif
+
+/* xh32 */
+
+static constexpr uint32_t p1 = 2654435761U, p2 = 2246822519U,
+                          p3 = 3266489917U, p4 = 668265263U, p5 = 374761393U;
+static constexpr int lanes = 32; /* Enough to hide multiply latency */
+static constexpr size_t stripe = lanes * sizeof(uint32_t);
+
+static inline uint32_t rotl(uint32_t v, int r) {
+    return (v << r) | (v >> (32 - r));
+}
+
+/* Lane merge and tail, shared by all kernels */
+static uint32_t xh32_finish(const uint32_t acc[lanes], const uint8_t *p,
+                            size_t n, size_t total) {
+    uint32_t h = total * p5;
+    for (int i = 0; i < lanes; ++i)
+        h += rotl(acc[i], i % 31 + 1);
+    for (; n >= 4; n -= 4, p += 4)
+        h = rotl(h + load32(p) * p3, 17) * p4;
+    for (; n; --n, ++p)
+        h = rotl(h + *p * p5, 11) * p1;
+    h ^= h >> 15;
+    h *= p2;
+    h ^= h >> 13;
+    h *= p3;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t xh32_seed(int lane) { return p1 * (lane + 1) + p2; }
+
+static uint32_t xh32_scalar(const void *data, size_t n) {
+    auto p = (const uint8_t *)data;
+    const size_t total = n;
+    uint32_t acc[lanes];
+    for (int i = 0; i < lanes; ++i)
+        acc[i] = xh32_seed(i);
+    for (; n >= stripe; n -= stripe, p += stripe)
+        for (int i = 0; i < lanes; ++i)
+            acc[i] = rotl(acc[i] + load32(p + 4 * i) * p2, 13) * p1;
+    return xh32_finish(acc, p, n, total);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2"))) static uint32_t
+xh32_sse41(const void *data, size_t n) {
+    auto p = (const uint8_t *)data;
+    const size_t total = n;
+    constexpr int regs = lanes / 4;
+    const __m128i vp1 = _mm_set1_epi32(p1), vp2 = _mm_set1_epi32(p2);
+    __m128i a[regs];
+    for (int r = 0; r < regs; ++r)
+        a[r] = _mm_setr_epi32(xh32_seed(4 * r), xh32_seed(4 * r + 1),
+                              xh32_seed(4 * r + 2), xh32_seed(4 * r + 3));
+    for (; n >= stripe; n -= stripe, p += stripe)
+        for (int r = 0; r < regs; ++r) {
+            __m128i x = _mm_loadu_si128((const __m128i *)p + r);
+            a[r] = _mm_add_epi32(a[r], _mm_mullo_epi32(x, vp2));
+            a[r] = _mm_or_si128(_mm_slli_epi32(a[r], 13),
+                                _mm_srli_epi32(a[r], 19));
+            a[r] = _mm_mullo_epi32(a[r], vp1);
+        }
+    uint32_t acc[lanes];
+    for (int r = 0; r < regs; ++r)
+        _mm_storeu_si128((__m128i *)acc + r, a[r]);
+    return xh32_finish(acc, p, n, total);
+}
+
+__attribute__((target("avx2"))) static uint32_t xh32_avx2(const void *data,
+                                                          size_t n) {
+    auto p = (const uint8_t *)data;
+    const size_t total = n;
+    constexpr int regs = lanes / 8;
+    const __m256i vp1 = _mm256_set1_epi32(p1), vp2 = _mm256_set1_epi32(p2);
+    __m256i a[regs];
+    for (int r = 0; r < regs; ++r) {
+        uint32_t seed[8];
+        for (int i = 0; i < 8; ++i)
+            seed[i] = xh32_seed(8 * r + i);
+        a[r] = _mm256_loadu_si256((const __m256i *)seed);
+    }
+    for (; n >= stripe; n -= stripe, p += stripe)
+        for (int r = 0; r < regs; ++r) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)p + r);
+            a[r] = _mm256_add_epi32(a[r], _mm256_mullo_epi32(x, vp2));
+            a[r] = _mm256_or_si256(_mm256_slli_epi32(a[r], 13),
+                                   _mm256_srli_epi32(a[r], 19));
+            a[r] = _mm256_mullo_epi32(a[r], vp1);
+        }
+    uint32_t acc[lanes];
+    for (int r = 0; r < regs; ++r)
+        _mm256_storeu_si256((__m256i *)acc + r, a[r]);
+    return xh32_finish(acc, p, n, total);
+}
+#endif
+
+const std::vector<checksum_kernel> &checksum_kernels() {
+    /* Other targets only have the scalar ones */
+    static const std::vector<checksum_kernel> kernels = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        bool sse42 = __builtin_cpu_supports("sse4.2");
+        bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        return std::vector<checksum_kernel>{
+#if defined(__x86_64__)
+            {"crc32c-sse4.2", checksum_crc32c, crc32c_sse42, sse42},
+#endif
+            {"crc32c-scalar", checksum_crc32c, crc32c_scalar, true},
+#if defined(__x86_64__) || defined(__i386__)
+            {"xh32-avx2", checksum_xh32, xh32_avx2, avx2},
+            {"xh32-sse4.1", checksum_xh32, xh32_sse41, sse42},
+#endif
+            {"xh32-scalar", checksum_xh32, xh32_scalar, true},
+        };
+    }();
+    return kernels;
+}
+
+const checksum_kernel *checksum_select(checksum_algo algo) {
+    for (auto &k : checksum_kernels())
+        if (k.algo == algo && k.supported)
+            return &k;
+    return nullptr;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Buffer checksums. Each algorithm has several kernels giving the very same
+ * result, the best one the CPU supports is picked at runtime:
+ *
+ * crc32c: Castagnoli CRC, scalar slicing-by-8 or the SSE4.2 crc32
+ *         instruction over three interleaved blocks.
+ * xh32:   xxhash style, 32 independent 32 bit multiply/rotate lanes over 128
+ *         byte stripes, then merged. Scalar, SSE4.1 (4 lanes per register)
+ *         or AVX2 (8 lanes per register).
+ * The SSE and AVX kernels are only built for x86. */
+enum checksum_algo { checksum_none, checksum_crc32c, checksum_xh32 };
+
+typedef uint32_t (*checksum_fn)(const void *data, size_t n);
+
+struct checksum_kernel {
+    const char *name;
+    checksum_algo algo;
+    checksum_fn fn;
+    bool supported;
+};
+
+/* All kernels, best first within an algorithm */
+const std::vector<checksum_kernel> &checksum_kernels();
+
+/* Best supported kernel of algo, nullptr for checksum_none */
+const checksum_kernel *checksum_select(checksum_algo algo);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <time.h>
+
+/* Time source of the simulation. All clocks share steady_clock time points,
+ * so they can be mixed with the existing code and each other's durations. */
+class sim_clock {
+  public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    virtual ~sim_clock() {}
+    virtual const char *name() const = 0;
+    virtual time_point now() = 0;
+    virtual void sleep_for(std::chrono::nanoseconds d) = 0;
+};
+
+class real_clock : public sim_clock {
+  public:
+    virtual const char *name() const override { return "real"; }
+    virtual time_point now() override {
+        return std::chrono::steady_clock::now();
+    }
+    virtual void sleep_for(std::chrono::nanoseconds d) override {
+        std::this_thread::sleep_for(d);
+    }
+};
+
+/* CLOCK_MONOTONIC_COARSE: same timeline as steady_clock on Linux, tick
+ * resolution only (~1-4ms), but a plain memory read in the vDSO. */
+class coarse_clock : public real_clock {
+  public:
+    virtual const char *name() const override { return "coarse"; }
+    virtual time_point now() override {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return time_point(std::chrono::seconds(ts.tv_sec) +
+                          std::chrono::nanoseconds(ts.tv_nsec));
+    }
+};
+
+/* Runs `scale` times faster than real time, starting from construction. */
+class scaled_clock : public sim_clock {
+  private:
+    time_point origin = std::chrono::steady_clock::now();
+    long scale;
+
+  public:
+    scaled_clock(long scale) : scale(scale > 0 ? scale : 1) {}
+    virtual const char *name() const override { return "scaled"; }
+    virtual time_point now() override {
+        return this->origin +
+               (std::chrono::steady_clock::now() - this->origin) * this->scale;
+    }
+    virtual void sleep_for(std::chrono::nanoseconds d) override {
+        std::this_thread::sleep_for(d / this->scale);
+    }
+};
+
+/* Time moves only by advance(). Meant for a single driver thread stepping the
+ * simulation, sleepers in other threads wake up once time got past them. */
+class manual_clock : public sim_clock {
+  private:
+    std::atomic<time_point> current{time_point{}};
+    std::mutex guard;
+    std::condition_variable advanced;
+
+  public:
+    virtual const char *name() const override { return "manual"; }
+    virtual time_point now() override { return this->current.load(); }
+    virtual void sleep_for(std::chrono::nanoseconds d) override {
+        auto until = this->now() + d;
+        std::unique_lock<std::mutex> lk(this->guard);
+        this->advanced.wait(lk, [this, until] { return this->now() >= until; });
+    }
+    void advance(std::chrono::nanoseconds d) {
+        {
+            std::unique_lock<std::mutex> lk(this->guard);
+            this->current.store(this->current.load() + d);
+        }
+        this->advanced.notify_all();
+    }
+};
@@ -0,0 +1,134 @@
+#include "compress.hpp"
+
+#include <cstring>
+
+static constexpr int hash_bits = 12;
+static constexpr size_t min_match = 4;
+static constexpr size_t max_offset = 65535;
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - hash_bits);
+}
+
+/* Length extension bytes: 255 while more, then the remainder */
+static inline bool put_len(uint8_t *&op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend)
+            return false;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return false;
+    *op++ = len;
+    return true;
+}
+
+static inline bool get_len(const uint8_t *&ip, const uint8_t *iend,
+                           size_t &len) {
+    uint8_t b;
+    do {
+        if (ip >= iend)
+            return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Emit one sequence, match_len 0 means the last, literals only, sequence */
+static bool put_seq(uint8_t *&op, const uint8_t *oend, const uint8_t *lit,
+                    size_t lit_len, size_t offset, size_t match_len) {
+    if (op >= oend)
+        return false;
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - min_match : 0;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+    if (lit_len >= 15 && !put_len(op, oend, lit_len - 15))
+        return false;
+    if ((size_t)(oend - op) < lit_len)
+        return false;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len)
+        return true;
+    if (oend - op < 2)
+        return false;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (ml >= 15 && !put_len(op, oend, ml - 15))
+        return false;
+    return true;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << hash_bits];
+    memset(table, 0xff, sizeof(table));
+
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    while (ip + min_match <= n) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash4(seq);
+        uint32_t ref = table[h];
+        table[h] = ip;
+        if (ref == UINT32_MAX || ip - ref > max_offset ||
+            read32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+        size_t len = min_match;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            ++len;
+        if (!put_seq(op, oend, src + anchor, ip - anchor, ip - ref, len))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!put_seq(op, oend, src + anchor, n - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+size_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_len(ip, iend, lit_len))
+            return 0;
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len)
+            return 0;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend)
+            break; /* Last sequence */
+
+        if (iend - ip < 2)
+            return 0;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && !get_len(ip, iend, len))
+            return 0;
+        len += min_match;
+        if (!offset || offset > (size_t)(op - dst) ||
+            (size_t)(oend - op) < len)
+            return 0;
+        /* Byte by byte, matches may overlap their own output */
+        for (const uint8_t *ref = op - offset; len; --len)
+            *op++ = *ref++;
+    }
+    return op - dst;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Self contained LZ77 byte codec, LZ4 block format: sequences of
+ * [token: literal len << 4 | (match len - 4)] [literal len extension]
+ * [literals] [16 bit LE offset] [match len extension], the last sequence has
+ * literals only. Single pass, 4 byte hash of the last position seen. */
+
+/* Bound on the compressed size of n bytes */
+constexpr size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+/* Returns the compressed size, 0 if it does not fit in cap */
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+/* Returns the decompressed size, 0 on malformed input or if it does not fit
+ * in cap */
+size_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
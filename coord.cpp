@@ -0,0 +1,411 @@
+#include "coord.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Listening or connected stream socket for "unix:PATH" or "HOST:PORT" */
+static int coord_socket(const std::string &addr, bool listening) {
+    int fd = -1;
+    if (addr.rfind("unix:", 0) == 0) {
+        struct sockaddr_un sun = {};
+        std::string path = addr.substr(5);
+        if (path.size() >= sizeof(sun.sun_path))
+            return -1;
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, path.c_str(), sizeof(sun.sun_path) - 1);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            return -1;
+        if (listening)
+            unlink(path.c_str());
+        int rc = listening ? bind(fd, (struct sockaddr *)&sun, sizeof(sun))
+                           : connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+        if (rc || (listening && listen(fd, 16))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    auto colon = addr.rfind(':');
+    if (colon == std::string::npos)
+        return -1;
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(addr.substr(0, colon).c_str(),
+                    addr.substr(colon + 1).c_str(), &hints, &res))
+        return -1;
+    for (auto ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int rc = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                           : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc || (listening && listen(fd, 16))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static bool send_all(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0)
+            return false;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Append whatever is readable to buf, false on EOF or error */
+static bool recv_some(int fd, std::string &buf) {
+    char chunk[1024];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+    if (n <= 0)
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    buf.append(chunk, n);
+    return true;
+}
+
+/* Pop complete fixed size messages of type T off the front of buf */
+template <typename T> static std::vector<T> take_msgs(std::string &buf) {
+    std::vector<T> msgs;
+    size_t off = 0;
+    for (; off + sizeof(T) <= buf.size(); off += sizeof(T)) {
+        T msg;
+        memcpy(&msg, buf.data() + off, sizeof(T));
+        if (msg.magic == T::magic_value)
+            msgs.push_back(msg);
+    }
+    buf.erase(0, off);
+    return msgs;
+}
+
+static long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+std::vector<coord_assign> coord_rebalance(const std::vector<coord_report> &r,
+                                          long budget) {
+    const size_t n = r.size();
+    std::vector<coord_assign> out(n);
+    std::vector<double> weight(n);
+    std::vector<long> hi(n), b(n);
+
+    if (budget <= 0) {
+        budget = 0;
+        for (auto &rep : r)
+            budget += rep.base_rsc;
+    }
+
+    double total_weight = 0;
+    for (size_t i = 0; i < n; ++i) {
+        weight[i] = (double)r[i].total_pressure *
+                    (1 + std::max(0.0, (double)r[i].backlog_ns / 1e9));
+        total_weight += weight[i];
+    }
+    if (total_weight == 0)
+        for (size_t i = 0; i < n; ++i)
+            weight[i] = r[i].base_rsc; /* Idle rack: back to configuration */
+
+    /* Floors, scaled down together if they alone exceed the budget */
+    long floors = 0;
+    for (size_t i = 0; i < n; ++i) {
+        hi[i] = r[i].capacity;
+        b[i] = std::min(r[i].base_rsc / 4, hi[i]);
+        floors += b[i];
+    }
+    if (floors > budget)
+        for (size_t i = 0; i < n; ++i)
+            b[i] = (double)b[i] * budget / floors;
+    long left = budget;
+    for (size_t i = 0; i < n; ++i)
+        left -= b[i];
+
+    /* Water filling: split what is left by weight, nodes that hit their
+     * capacity drop out and the rest is split again */
+    while (left > 0) {
+        double w = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (b[i] < hi[i])
+                w += weight[i];
+        if (w <= 0)
+            break;
+        long given = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (b[i] >= hi[i])
+                continue;
+            long add = std::min((long)(left * weight[i] / w), hi[i] - b[i]);
+            b[i] += add;
+            given += add;
+        }
+        if (!given) {
+            /* Rounding leftovers, one by one to the heaviest */
+            size_t best = n;
+            for (size_t i = 0; i < n; ++i)
+                if (b[i] < hi[i] && weight[i] > 0 &&
+                    (best == n || weight[i] > weight[best]))
+                    best = i;
+            if (best == n)
+                break;
+            b[best]++;
+            given = 1;
+        }
+        left -= given;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        out[i].magic = coord_assign::magic_value;
+        out[i].node = r[i].node;
+        out[i].total_rsc = b[i];
+        out[i].reserve =
+            r[i].base_rsc ? r[i].base_reserve * b[i] / r[i].base_rsc : 0;
+    }
+    return out;
+}
+
+coord_server::coord_server(const std::string &addr, long budget,
+                           long period_ms)
+    : addr(addr), budget(budget), period_ms(std::max(10L, period_ms)) {
+    this->fd = coord_socket(addr, true);
+    if (this->fd < 0)
+        return;
+    this->listening = true;
+    this->running = true;
+    this->thread = std::thread(&coord_server::main, this);
+}
+
+coord_server::~coord_server() {
+    this->running = false;
+    if (this->thread.joinable())
+        this->thread.join();
+    if (this->fd >= 0) {
+        close(this->fd);
+        if (this->addr.rfind("unix:", 0) == 0)
+            unlink(this->addr.substr(5).c_str());
+    }
+}
+
+void coord_server::main() {
+    struct conn {
+        std::string buf;
+        coord_report last;
+        unsigned long heard = 0; /* Round of the last report, 0 if none */
+    };
+    std::map<int, conn> conns;
+    long next = now_ms() + this->period_ms;
+
+    while (this->running) {
+        std::vector<struct pollfd> pfds = {{.fd = this->fd, .events = POLLIN}};
+        for (auto &c : conns)
+            pfds.push_back({.fd = c.first, .events = POLLIN});
+        long timeout = std::min(200L, std::max(0L, next - now_ms()));
+        if (poll(pfds.data(), pfds.size(), timeout) > 0) {
+            for (size_t i = 1; i < pfds.size(); ++i) {
+                if (!pfds[i].revents)
+                    continue;
+                auto &c = conns[pfds[i].fd];
+                if (!recv_some(pfds[i].fd, c.buf)) {
+                    close(pfds[i].fd);
+                    conns.erase(pfds[i].fd);
+                    continue;
+                }
+                auto reports = take_msgs<coord_report>(c.buf);
+                if (!reports.empty()) {
+                    c.last = reports.back(); /* Older ones are stale */
+                    c.heard = this->rounds + 1;
+                }
+            }
+            if (pfds[0].revents & POLLIN) {
+                int cfd = accept4(this->fd, NULL, NULL, SOCK_CLOEXEC);
+                if (cfd >= 0)
+                    conns[cfd];
+            }
+        }
+        this->nodes = conns.size();
+
+        if (now_ms() < next)
+            continue;
+        next += this->period_ms;
+        unsigned long round = ++this->rounds;
+
+        /* Nodes silent for 3 rounds do not count for the rack */
+        std::vector<int> fds;
+        std::vector<coord_report> reports;
+        for (auto &c : conns) {
+            if (c.second.heard && round - c.second.heard <= 3) {
+                fds.push_back(c.first);
+                reports.push_back(c.second.last);
+            }
+        }
+        auto assigns = coord_rebalance(reports, this->budget);
+        for (size_t i = 0; i < assigns.size(); ++i) {
+            assigns[i].seq = round;
+            if (!send_all(fds[i], &assigns[i], sizeof(assigns[i]))) {
+                close(fds[i]);
+                conns.erase(fds[i]);
+            }
+        }
+    }
+
+    for (auto &c : conns)
+        close(c.first);
+}
+
+/* Distinct for every coord_node of a rack: a process may run several, one
+ * after another or at once as in coord_check() */
+static uint32_t node_id() {
+    static std::atomic_uint count = 0;
+    return (uint32_t)getpid() << 8 | (count++ & 0xff);
+}
+
+coord_node::coord_node(const std::string &addr, long period_ms,
+                       sample_fn sample, apply_fn apply)
+    : addr(addr), period_ms(std::max(10L, period_ms)), node(node_id()),
+      sample(sample), apply(apply) {
+    this->running = true;
+    this->thread = std::thread(&coord_node::main, this);
+}
+
+coord_node::~coord_node() {
+    this->running = false;
+    if (this->thread.joinable())
+        this->thread.join();
+}
+
+void coord_node::main() {
+    int fd = -1;
+    uint64_t seq = 0;
+    std::string buf;
+    long next = now_ms();
+
+    while (this->running) {
+        long now = now_ms();
+        if (now >= next) {
+            next = now + this->period_ms;
+            if (fd < 0) {
+                fd = coord_socket(this->addr, false);
+                buf.clear();
+            }
+            if (fd >= 0) {
+                coord_report r = {};
+                this->sample(r);
+                r.magic = coord_report::magic_value;
+                r.node = this->node;
+                r.seq = ++seq;
+                if (!send_all(fd, &r, sizeof(r))) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            this->connected = fd >= 0;
+        }
+
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(
+                std::min(200L, std::max(0L, next - now_ms()))));
+            continue;
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        long timeout = std::min(200L, std::max(0L, next - now_ms()));
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+        if (!recv_some(fd, buf)) {
+            close(fd);
+            fd = -1;
+            this->connected = false;
+            continue;
+        }
+        for (auto &a : take_msgs<coord_assign>(buf)) {
+            if (a.node != this->node)
+                continue;
+            this->total_rsc = a.total_rsc;
+            this->reserve = a.reserve;
+            this->apply(a.total_rsc, a.reserve);
+            this->updates++;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+bool coord_check(std::ostream &os) {
+    bool ok = true;
+    auto check = [&](bool cond, const std::string &what) {
+        os << "  " << what << ": " << (cond ? "ok" : "FAILED") << std::endl;
+        ok &= cond;
+    };
+    auto sum = [](const std::vector<coord_assign> &a) {
+        long n = 0;
+        for (auto &e : a)
+            n += e.total_rsc;
+        return n;
+    };
+    auto report = [](uint32_t node, uint64_t pressure, long base) {
+        coord_report r = {};
+        r.magic = coord_report::magic_value;
+        r.node = node;
+        r.total_pressure = pressure;
+        r.capacity = 4 * base;
+        r.base_rsc = base;
+        r.base_reserve = base / 10;
+        return r;
+    };
+
+    os << "Coordination" << std::endl;
+    std::vector<coord_report> rack = {report(1, 300, 600),
+                                      report(2, 100, 400)};
+    auto a = coord_rebalance(rack, 0);
+    check(sum(a) == 1000 && a[0].total_rsc > a[1].total_rsc,
+          "split by pressure within the budget");
+    a = coord_rebalance(rack, 200);
+    check(sum(a) <= 200, "floors scaled down to a small budget");
+    rack[0].capacity = 300;
+    a = coord_rebalance(rack, 0);
+    check(sum(a) == 1000 && a[0].total_rsc == 300, "bounded by capacity");
+
+    /* A server and two nodes over a unix socket, as in a rack */
+    std::string addr =
+        "unix:/tmp/capuchinos-coord-" + std::to_string(getpid()) + ".sock";
+    coord_server server(addr, 1000, 20);
+    check(server.is_listening(), "server listening on " + addr);
+    std::atomic_long got[2] = {};
+    auto node = [&](int i, uint64_t pressure, long base) {
+        return std::make_unique<coord_node>(
+            addr, 20,
+            [=](coord_report &r) { r = report(0, pressure, base); },
+            [&got, i](long total_rsc, long) { got[i] = total_rsc; });
+    };
+    auto n0 = node(0, 300, 600), n1 = node(1, 100, 400);
+    check(n0->get_node() != n1->get_node(), "nodes have distinct ids");
+    for (int i = 0; i < 200 && (!n0->get_updates() || !n1->get_updates() ||
+                                got[0] + got[1] != 1000);
+         ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    check(n0->get_updates() && n1->get_updates(), "both nodes assigned");
+    check(got[0] + got[1] == 1000 && got[0] > got[1],
+          "assignments add up to the rack budget");
+    return ok;
+}
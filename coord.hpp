@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Rack level buffer budget coordination.
+ *
+ * Every node (a simulator process with its own pool) runs a coord_node that
+ * once a period sends one fixed size report to the coord_server: aggregate
+ * pressure, disk backlog, physical pool capacity and the budget it was
+ * configured with. Once a period the server splits the rack budget (the sum
+ * of configured budgets unless given) between the nodes it heard from, in
+ * proportion to pressure * (1 + backlog in seconds), bounded by each node's
+ * capacity and a quarter of its configured budget, and answers every node
+ * with one fixed size assignment. So each node costs one small write each
+ * way per period, whatever the number of nodes.
+ *
+ * Addresses are "unix:PATH" or "HOST:PORT" (TCP). */
+
+struct coord_report {
+    static constexpr uint32_t magic_value = 0xc0041;
+    uint32_t magic;
+    uint32_t node;
+    uint64_t seq;
+    uint64_t total_pressure;
+    int64_t backlog_ns;
+    int64_t capacity;     /* Physical buffers of the node's pool */
+    int64_t base_rsc;     /* Configured budget, before any assignment */
+    int64_t base_reserve; /* Likewise for the reserve */
+};
+
+struct coord_assign {
+    static constexpr uint32_t magic_value = 0xc0042;
+    uint32_t magic;
+    uint32_t node;
+    uint64_t seq; /* Of the round, not of the report */
+    int64_t total_rsc;
+    int64_t reserve;
+};
+
+/* Pure budget split, exposed for the server and whoever wants to reason
+ * about it. budget <= 0 means sum of base_rsc. */
+std::vector<coord_assign> coord_rebalance(const std::vector<coord_report> &r,
+                                          long budget);
+
+/* coord_rebalance() cases, then a coord_server and two coord_nodes talking
+ * over a unix socket. Prints each check, false if any failed. */
+bool coord_check(std::ostream &os);
+
+class coord_server {
+  private:
+    std::string addr;
+    long budget;
+    long period_ms;
+    int fd = -1;
+    std::atomic_bool running = false;
+    std::atomic_bool listening = false;
+    std::atomic_ulong rounds = 0;
+    std::atomic_int nodes = 0;
+    std::thread thread;
+
+    void main();
+
+  public:
+    coord_server(const std::string &addr, long budget, long period_ms);
+    ~coord_server();
+
+    const std::string &get_addr() const { return this->addr; }
+    bool is_listening() const { return this->listening; }
+    unsigned long get_rounds() const { return this->rounds; }
+    int get_nodes() const { return this->nodes; }
+};
+
+class coord_node {
+  public:
+    /* Fill everything but magic, node and seq */
+    typedef std::function<void(coord_report &)> sample_fn;
+    typedef std::function<void(long total_rsc, long reserve)> apply_fn;
+
+  private:
+    std::string addr;
+    long period_ms;
+    uint32_t node; /* pid << 8 | per process count, see node_id() */
+    sample_fn sample;
+    apply_fn apply;
+    std::atomic_bool running = false;
+    std::atomic_bool connected = false;
+    std::atomic_ulong updates = 0;
+    std::atomic_long total_rsc = 0, reserve = 0;
+    std::thread thread;
+
+    void main();
+
+  public:
+    coord_node(const std::string &addr, long period_ms, sample_fn sample,
+               apply_fn apply);
+    ~coord_node();
+
+    const std::string &get_addr() const { return this->addr; }
+    uint32_t get_node() const { return this->node; }
+    bool is_connected() const { return this->connected; }
+    unsigned long get_updates() const { return this->updates; }
+    long get_total_rsc() const { return this->total_rsc; }
+    long get_reserve() const { return this->reserve; }
+};
@@ -0,0 +1,88 @@
+#include "disk_model.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+
+/* Uniform in (0, 1) from any 64 bit value, see splitmix64 */
+static double uniform(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return ((x >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* A sample in ns, at most an hour: heavy tails would overflow a long */
+static long capped(double ns) { return (long)std::min(ns, 3600e9); }
+
+bool disk_model::load_trace(const std::string &path) {
+    std::ifstream f(path);
+    std::vector<long> trace;
+    long us;
+    while (f >> us)
+        trace.push_back(std::max(0L, us));
+    if (trace.empty()) {
+        this->error = path + ": no latencies";
+        return false;
+    }
+    this->trace_us = trace;
+    this->error.clear();
+    return true;
+}
+
+long disk_model::jitter_ns(int dist, long mean_us, long shape_pct,
+                           unsigned long seq) const {
+    double mean = mean_us * 1000.0;
+    double u = uniform(seq);
+    switch (dist) {
+    case latency_exponential:
+        return capped(-mean * std::log(u));
+    case latency_lognormal: {
+        /* Box-Muller, mean kept at mean whatever sigma */
+        double sigma = shape_pct / 100.0;
+        double z = std::sqrt(-2 * std::log(u)) *
+                   std::cos(2 * M_PI * uniform(~seq));
+        return capped(mean * std::exp(sigma * z - sigma * sigma / 2));
+    }
+    case latency_pareto: {
+        double alpha = std::max(1.01, shape_pct / 100.0);
+        return capped(mean * (alpha - 1) / alpha / std::pow(u, 1 / alpha));
+    }
+    case latency_trace:
+        if (this->trace_us.empty())
+            return 0;
+        return this->trace_us[seq % this->trace_us.size()] * 1000;
+    default:
+        return 0;
+    }
+}
+
+long disk_model::stall_end(long t, long every_ms, long rate_per_min,
+                           long stall_ms) {
+    long stall = stall_ms * 1000000L;
+    if (stall <= 0)
+        return t;
+    /* Random stalls: each stall long slot of time is one with the odds of
+     * rate_per_min of them a minute, decided by hashing its number */
+    double odds = std::min(0.5, rate_per_min * stall_ms / 60000.0);
+    /* Out of one stall may be into the next */
+    for (int i = 0; i < 64; ++i) {
+        long end = t;
+        if (every_ms > 0 && t % (every_ms * 1000000L) < stall)
+            end = t - t % (every_ms * 1000000L) + stall;
+        else if (odds > 0 && uniform(t / stall) < odds)
+            end = (t / stall + 1) * stall;
+        if (end == t)
+            break;
+        t = end;
+    }
+    return t;
+}
+
+long disk_model::at_depth(long ns, long depth, long saturation) {
+    if (saturation <= 0)
+        return ns;
+    return ns * saturation / std::clamp(depth, 1L, saturation);
+}
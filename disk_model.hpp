@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* Per job latency distributions of disk_conf.jitter_dist */
+enum latency_dist {
+    latency_none,
+    latency_exponential,
+    latency_lognormal, /* disk_conf.jitter_shape_pct is sigma * 100 */
+    latency_pareto,    /* disk_conf.jitter_shape_pct is alpha * 100, > 100 */
+    latency_trace,     /* Replayed from --disk-trace, in a loop */
+};
+
+/* What makes disk_sim less than a steady server: extra service time per
+ * job, stalls the disk does nothing during, bandwidth depending on queue
+ * depth. Each is a pure function of a job sequence number or a point in
+ * time, so threads share nothing but a counter and manually clocked runs
+ * replay the same. */
+class disk_model {
+  private:
+    std::vector<long> trace_us;
+    std::string error;
+
+  public:
+    /* Latencies in microseconds, one per line. False if none could be read,
+     * see get_error() */
+    bool load_trace(const std::string &path);
+
+    /* Extra service time of job seq, mean_us on average but for a trace,
+     * at most an hour */
+    long jitter_ns(int dist, long mean_us, long shape_pct,
+                   unsigned long seq) const;
+    /* End of the stall t (ns) falls in, t itself if none. Stalls of stall_ms
+     * start every every_ms, and at random rate_per_min times a minute. */
+    static long stall_end(long t, long every_ms, long rate_per_min,
+                          long stall_ms);
+    /* Service time of a job alone, ns, when depth jobs are queued: the disk
+     * only gets to full bandwidth with saturation of them, 0 for always */
+    static long at_depth(long ns, long depth, long saturation);
+
+    size_t get_trace_size() const { return this->trace_us.size(); }
+    const std::string &get_error() const { return this->error; }
+};
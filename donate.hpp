@@ -0,0 +1,181 @@
+#pragma once
+
+#include "metrics.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+/* Buffer ids handed straight from one capuch to another, lock-free. Bounded
+ * ring for many donors and the one owner taking them out: a donor claims a
+ * cell by moving tail, the cell's sequence tells whose turn it is. */
+class mailbox {
+  public:
+    static constexpr unsigned capacity = 64; /* Power of 2 */
+
+  private:
+    struct cell {
+        std::atomic_uint seq;
+        int id;
+    };
+    alignas(cache_line) std::atomic_uint tail{0}; /* Donors */
+    alignas(cache_line) unsigned head = 0;        /* Owner only */
+    cell cells[capacity];
+
+  public:
+    /* Buffers the owner is short of, less those donated it has not taken
+     * out yet. Donors subtract what they give, the owner adds its own
+     * changes, so neither overwrites the other's. */
+    alignas(cache_line) std::atomic_long want{0};
+    std::atomic_int donors{0}; /* Pushing right now */
+    std::atomic_bool open{false};
+
+    mailbox() {
+        for (unsigned i = 0; i < capacity; ++i)
+            this->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /* Any thread. False if full */
+    bool push(int id) {
+        unsigned pos = this->tail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &c = this->cells[pos % capacity];
+            int diff = (int)(c.seq.load(std::memory_order_acquire) - pos);
+            if (diff < 0)
+                return false;
+            if (diff > 0)
+                pos = this->tail.load(std::memory_order_relaxed);
+            else if (this->tail.compare_exchange_weak(
+                         pos, pos + 1, std::memory_order_relaxed)) {
+                c.id = id;
+                c.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    /* Owner only. False if empty */
+    bool pop(int &id) {
+        auto &c = this->cells[this->head % capacity];
+        if ((int)(c.seq.load(std::memory_order_acquire) - (this->head + 1)) < 0)
+            return false;
+        id = c.id;
+        c.seq.store(this->head + capacity, std::memory_order_release);
+        this->head++;
+        return true;
+    }
+};
+
+/* A mailbox per capuch of the process. Capuches with buffers over their
+ * quota give them to the one that wants the most, instead of to the pool
+ * for it to take them out again: no lock, and the buffers never show up in
+ * the pool's free counts. Buffers stay owned by the process throughout.
+ * Boxes come in chunks allocated as capuches are added, and stay where
+ * they are for lock-free readers. */
+class donation_board {
+  public:
+    static constexpr int chunk = 256;
+    static constexpr int max_chunks = 64;
+    static constexpr int max_boxes = chunk * max_chunks;
+
+    struct {
+        sharded_counter donations;
+        sharded_counter donated;  /* Buffers */
+        std::atomic_int boxless{0}; /* Capuches open() had no box for */
+    } stats;
+
+  private:
+    std::atomic<mailbox *> chunks[max_chunks] = {};
+    std::atomic_int used{0}; /* Boxes ever opened, the ones to scan */
+    std::atomic_int nopen{0}; /* Not worth a scan for a box at max_boxes */
+
+    /* Chunk c allocated, by whichever thread gets there first */
+    void grow(int c) {
+        if (this->chunks[c].load(std::memory_order_acquire))
+            return;
+        auto fresh = new mailbox[chunk];
+        mailbox *none = nullptr;
+        if (!this->chunks[c].compare_exchange_strong(
+                none, fresh, std::memory_order_acq_rel))
+            delete[] fresh;
+    }
+
+  public:
+    donation_board() = default;
+    donation_board(const donation_board &) = delete;
+    ~donation_board() {
+        for (auto &c : this->chunks)
+            delete[] c.load();
+    }
+
+    /* A box for a new capuch, -1 if none left. A capuch without one neither
+     * gives nor takes donations, close(-1) when it goes. */
+    int open() {
+        if (this->nopen.load(std::memory_order_relaxed) == max_boxes) {
+            this->stats.boxless++;
+            return -1;
+        }
+        for (int i = 0; i < max_boxes; ++i) {
+            if (i % chunk == 0)
+                this->grow(i / chunk);
+            bool closed = false;
+            if (this->get(i).open.compare_exchange_strong(closed, true)) {
+                this->nopen++;
+                int used = this->used.load();
+                while (used <= i &&
+                       !this->used.compare_exchange_weak(used, i + 1))
+                    ;
+                return i;
+            }
+        }
+        this->stats.boxless++;
+        return -1;
+    }
+    /* Close box i once no donor is pushing to it, ids still in it go to
+     * back (the pool) */
+    void close(int i, const std::function<void(int)> &back) {
+        if (i < 0) {
+            this->stats.boxless--;
+            return;
+        }
+        auto &box = this->get(i);
+        box.open = false;
+        this->nopen--;
+        while (box.donors.load())
+            std::this_thread::yield();
+        box.want = 0; /* Once no donor can take off it */
+        int id;
+        while (box.pop(id))
+            back(id);
+    }
+    mailbox &get(int i) {
+        auto boxes = this->chunks[i / chunk].load(std::memory_order_acquire);
+        return boxes[i % chunk];
+    }
+
+    /* The open box, other than self, wanting the most. Donors must give it
+     * back with release() as soon as they are done pushing. */
+    mailbox *neediest(int self) {
+        int best = -1;
+        long most = 0;
+        for (int i = 0; i < this->used.load(std::memory_order_acquire); ++i) {
+            auto &box = this->get(i);
+            long want = box.want.load(std::memory_order_relaxed);
+            if (i != self && want > most &&
+                box.open.load(std::memory_order_relaxed)) {
+                best = i;
+                most = want;
+            }
+        }
+        if (best < 0)
+            return nullptr;
+        auto &box = this->get(best);
+        box.donors++;
+        if (!box.open) { /* Closing, see close() */
+            box.donors--;
+            return nullptr;
+        }
+        return &box;
+    }
+    void release(mailbox *box) { box->donors--; }
+};
@@ -0,0 +1,284 @@
+#include "flush.hpp"
+#include "compress.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#include <time.h>
+
+static unsigned long thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+flush_pipeline::flush_pipeline(submit_fn submit, const options &opts)
+    : submit(submit), opts(opts), kernel(checksum_select(opts.checksum)) {
+    if (!this->opts.path.empty()) {
+        this->file = fopen(this->opts.path.c_str(), "wb");
+        flush_file_header hdr;
+        memcpy(hdr.magic, hdr.magic_value, sizeof(hdr.magic));
+        hdr.algo = this->kernel ? this->kernel->algo : checksum_none;
+        hdr.buf_size = this->opts.buf_size;
+        if (!this->file || fwrite(&hdr, sizeof(hdr), 1, this->file) != 1) {
+            this->error = this->opts.path + ": " + strerror(errno);
+            if (this->file)
+                fclose(this->file);
+            this->file = nullptr;
+        }
+    }
+    this->placement.role = "flusher";
+    this->placement.cpus = this->opts.cpus;
+    this->placement.fifo = this->opts.fifo;
+    this->placement.numa = this->opts.numa;
+    if (this->opts.threaded)
+        this->thread = std::thread(&flush_pipeline::main, this);
+}
+
+flush_pipeline::~flush_pipeline() {
+    {
+        std::unique_lock<std::mutex> lk(this->guard);
+        this->running = false;
+    }
+    this->cv.notify_all();
+    if (this->thread.joinable())
+        this->thread.join();
+    if (this->file)
+        fclose(this->file);
+}
+
+void flush_pipeline::push(flush_job *job) {
+    if (!this->opts.threaded) {
+        this->process(job);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lk(this->guard);
+        this->queue.push_back(job);
+    }
+    this->cv.notify_one();
+}
+
+void flush_pipeline::main() {
+    this->placement.apply();
+    std::unique_lock<std::mutex> lk(this->guard);
+    while (this->running) {
+        if (this->queue.empty()) {
+            this->cv.wait(lk);
+            continue;
+        }
+        auto job = this->queue.front();
+        this->queue.pop_front();
+        lk.unlock();
+        this->process(job);
+        this->placement.sample();
+        lk.lock();
+    }
+}
+
+void flush_pipeline::process(flush_job *job) {
+    long raw = job->raw_bytes();
+    long out = 0;
+
+    if (this->opts.compress)
+        this->scratch.resize(lz_bound(job->buf_size));
+    for (auto &buf : job->bufs) {
+        flush_record rec = {flush_record::magic_value,
+                            (uint16_t)job->capuch,
+                            0,
+                            (uint32_t)job->batch_id,
+                            (uint32_t)buf.used,
+                            (uint32_t)buf.used,
+                            0};
+        const void *data = buf.data;
+
+        if (this->kernel) {
+            auto start = thread_cpu_ns();
+            rec.checksum = this->kernel->fn(buf.data, buf.used);
+            this->stats.checksum_ns += thread_cpu_ns() - start;
+        }
+
+        if (this->opts.compress) {
+            auto start = thread_cpu_ns();
+            size_t n = lz_compress((const uint8_t *)buf.data, buf.used,
+                                   this->scratch.data(), this->scratch.size());
+            /* Incompressible buffers are written as is */
+            if (n && (long)n < buf.used) {
+                rec.flags |= flush_record::flag_lz;
+                rec.stored_len = n;
+                data = this->scratch.data();
+            }
+            this->stats.compress_ns += thread_cpu_ns() - start;
+        }
+
+        if (this->file &&
+            (fwrite(&rec, sizeof(rec), 1, this->file) != 1 ||
+             fwrite(data, rec.stored_len, 1, this->file) != 1))
+            this->stats.write_errors++;
+        out += rec.stored_len;
+    }
+    if (this->file)
+        fflush(this->file);
+
+    this->stats.jobs++;
+    this->stats.bufs += job->bufs.size();
+    this->stats.raw_bytes += raw;
+    this->stats.out_bytes += out;
+    job->bytes = out;
+    this->submit(job);
+}
+
+void group_commit::push(flush_job *job, sim_clock::time_point now) {
+    std::unique_lock<std::mutex> lk(this->guard);
+    if (this->pending.empty())
+        this->oldest = now;
+    this->pending.push_back(job);
+    this->pending_bytes += job->bytes;
+    this->empty.store(false, std::memory_order_relaxed);
+    if (this->pending_bytes >= this->max_bytes || this->window.count() <= 0)
+        this->commit(lk);
+}
+
+void group_commit::poll(sim_clock::time_point now) {
+    if (this->empty.load(std::memory_order_relaxed))
+        return;
+    std::unique_lock<std::mutex> lk(this->guard);
+    if (!this->pending.empty() && now - this->oldest >= this->window)
+        this->commit(lk);
+}
+
+void group_commit::flush() {
+    std::unique_lock<std::mutex> lk(this->guard);
+    if (!this->pending.empty())
+        this->commit(lk);
+}
+
+void group_commit::commit(std::unique_lock<std::mutex> &lk) {
+    auto finish = this->submit(this->pending_bytes, this->pending.size());
+    this->stats.groups++;
+    this->stats.jobs += this->pending.size();
+    this->stats.bytes += this->pending_bytes;
+    /* Fan out, each capuch sees its job submitted on its next step */
+    for (auto job : this->pending)
+        job->finish.store(finish, std::memory_order_release);
+    this->pending.clear();
+    this->pending_bytes = 0;
+    this->empty.store(true, std::memory_order_relaxed);
+}
+
+long flush_verify(const std::string &path, std::ostream &os) {
+    std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(path.c_str(), "rb"),
+                                                fclose);
+    if (!file) {
+        os << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    flush_file_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, file.get()) != 1 ||
+        memcmp(hdr.magic, hdr.magic_value, sizeof(hdr.magic))) {
+        os << path << ": not a flush file" << std::endl;
+        return -1;
+    }
+    auto kernel = checksum_select((checksum_algo)hdr.algo);
+    if (hdr.algo != checksum_none && !kernel) {
+        os << path << ": unknown checksum " << hdr.algo << std::endl;
+        return -1;
+    }
+    os << path << ": buf_size=" << hdr.buf_size
+       << " checksum=" << (kernel ? kernel->name : "none") << std::endl;
+
+    std::vector<unsigned char> stored, raw(hdr.buf_size);
+    long records = 0, bad = 0, compressed = 0;
+    flush_record rec;
+    while (fread(&rec, sizeof(rec), 1, file.get()) == 1) {
+        if (rec.magic != flush_record::magic_value ||
+            rec.raw_len > hdr.buf_size ||
+            rec.stored_len > lz_bound(hdr.buf_size)) {
+            os << "record " << records << ": bad header, giving up"
+               << std::endl;
+            return bad + 1;
+        }
+        stored.resize(rec.stored_len);
+        if (fread(stored.data(), 1, rec.stored_len, file.get()) !=
+            rec.stored_len) {
+            os << "record " << records << ": truncated" << std::endl;
+            return bad + 1;
+        }
+
+        const unsigned char *data = stored.data();
+        size_t len = rec.stored_len;
+        if (rec.flags & flush_record::flag_lz) {
+            compressed++;
+            len = lz_decompress(stored.data(), stored.size(), raw.data(),
+                                raw.size());
+            data = raw.data();
+        }
+        if (len != rec.raw_len) {
+            os << "record " << records << ": capuch " << rec.capuch
+               << " batch " << rec.batch_id << " bad length " << len
+               << std::endl;
+            bad++;
+        } else if (kernel && kernel->fn(data, len) != rec.checksum) {
+            os << "record " << records << ": capuch " << rec.capuch
+               << " batch " << rec.batch_id << " checksum mismatch"
+               << std::endl;
+            bad++;
+        }
+        records++;
+    }
+    os << "records=" << records << " compressed=" << compressed
+       << " bad=" << bad << std::endl;
+    return bad;
+}
+
+void flush_bench(std::ostream &os) {
+    constexpr size_t buf_size = 4096;
+    constexpr size_t total = 256UL << 20;
+    /* Half random, half trace like: not that it matters to checksums */
+    std::vector<unsigned char> buf(buf_size);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < buf_size; ++i) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        buf[i] = i < buf_size / 2 ? x : i / 32;
+    }
+
+    auto gbps = [](size_t bytes, unsigned long ns) {
+        return (double)bytes / std::max(1UL, ns);
+    };
+
+    os << "Single core, " << buf_size << " byte buffers, GB/s" << std::endl;
+    uint32_t reference[3] = {};
+    for (auto &k : checksum_kernels()) {
+        os << "  " << k.name << ": ";
+        if (!k.supported) {
+            os << "not supported" << std::endl;
+            continue;
+        }
+        uint32_t sum = k.fn(buf.data(), buf.size());
+        if (!reference[k.algo])
+            reference[k.algo] = sum;
+        auto first = buf[0];
+        auto start = thread_cpu_ns();
+        volatile uint32_t sink = 0;
+        for (size_t done = 0; done < total; done += buf_size) {
+            buf[0] = done; /* Defeat hoisting */
+            sink = sink ^ k.fn(buf.data(), buf.size());
+        }
+        os << gbps(total, thread_cpu_ns() - start);
+        buf[0] = first;
+        if (sum != reference[k.algo])
+            os << " MISMATCH";
+        os << std::endl;
+    }
+
+    std::vector<unsigned char> scratch(lz_bound(buf_size));
+    size_t out = 0, lz_total = total / 16;
+    auto start = thread_cpu_ns();
+    for (size_t done = 0; done < lz_total; done += buf_size)
+        out += lz_compress(buf.data(), buf.size(), scratch.data(),
+                           scratch.size());
+    os << "  lz-compress: " << gbps(lz_total, thread_cpu_ns() - start)
+       << " ratio " << (double)lz_total / std::max(1UL, out) << std::endl;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "affinity.hpp"
+#include "checksum.hpp"
+#include "clock.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* A batch of ready buffers on its way to disk. The capuch fills bufs and
+ * hands it to a flush_pipeline, finish stays time_point::max() until the
+ * disk accepted the batch. Only the bytes written of each buffer go, a
+ * producer may hand one over before it is full. */
+struct flush_job {
+    struct buffer {
+        const char *data;
+        long used; /* At most buf_size */
+    };
+    std::vector<buffer> bufs;
+    long buf_size = 0;
+    int capuch = 0;
+    int batch_id = 0;
+    long bytes = 0; /* What the disk was charged for */
+    std::atomic<sim_clock::time_point> finish{sim_clock::time_point::max()};
+
+    void reset() {
+        this->bufs.clear();
+        this->bytes = 0;
+        this->finish.store(sim_clock::time_point::max());
+    }
+    /* The bytes of all bufs */
+    long raw_bytes() const {
+        long n = 0;
+        for (auto &b : this->bufs)
+            n += b.used;
+        return n;
+    }
+    bool submitted() const {
+        return this->finish.load(std::memory_order_acquire) !=
+               sim_clock::time_point::max();
+    }
+};
+
+/* Flush file: a header, then one record per buffer followed by its stored
+ * bytes. The checksum is of the raw buffer, before compression, so that
+ * verifying covers the whole way from the capuch to the file. */
+struct flush_file_header {
+    static constexpr char magic_value[8] = {'C', 'A', 'P', 'U',
+                                            'C', 'H', 'F', '1'};
+    char magic[8];
+    uint32_t algo; /* checksum_algo */
+    uint32_t buf_size;
+};
+
+struct flush_record {
+    static constexpr uint32_t magic_value = 0xcafe5eed;
+    static constexpr uint16_t flag_lz = 1;
+    uint32_t magic;
+    uint16_t capuch;
+    uint16_t flags;
+    uint32_t batch_id;
+    uint32_t raw_len;
+    uint32_t stored_len;
+    uint32_t checksum;
+};
+
+/* Processing between on_flush_start and the disk: optional stages run on each
+ * buffer of a job (checksum, compression, writing to the flush file), then
+ * the job is submitted to the disk by its output size. Stages run on a worker
+ * thread, or inline in push() when not threaded (manual clock, to stay
+ * deterministic). */
+class flush_pipeline {
+  public:
+    /* Hands a processed job, job->bytes set, on to the disk, which sets
+     * job->finish now or later */
+    typedef std::function<void(flush_job *job)> submit_fn;
+
+    struct options {
+        bool compress = false;
+        checksum_algo checksum = checksum_none;
+        std::string path; /* Flush file, none if empty */
+        long buf_size = 0;
+        bool threaded = true;
+        cpu_list cpus; /* Of the worker thread, see thread_placement */
+        int fifo = 0;
+        bool numa = false;
+    };
+
+    struct {
+        std::atomic_ulong jobs = 0;
+        std::atomic_ulong bufs = 0;
+        std::atomic_ulong raw_bytes = 0;
+        std::atomic_ulong out_bytes = 0;
+        std::atomic_ulong compress_ns = 0; /* Thread CPU time */
+        std::atomic_ulong checksum_ns = 0; /* Thread CPU time */
+        std::atomic_ulong write_errors = 0;
+    } stats;
+
+  private:
+    submit_fn submit;
+    options opts;
+    const checksum_kernel *kernel; /* nullptr if no checksum stage */
+    FILE *file = nullptr;
+    std::string error;
+    std::vector<unsigned char> scratch;
+
+    std::mutex guard;
+    std::condition_variable cv;
+    std::deque<flush_job *> queue;
+    bool running = true;
+    std::thread thread;
+    thread_placement placement;
+
+    void process(flush_job *job);
+    void main();
+
+  public:
+    flush_pipeline(submit_fn submit, const options &opts);
+    ~flush_pipeline();
+
+    /* The job must stay alive until it is submitted or the pipeline gone */
+    void push(flush_job *job);
+
+    const checksum_kernel *get_kernel() const { return this->kernel; }
+    const std::string &get_error() const { return this->error; }
+    /* Of the worker thread, nullptr if not threaded */
+    const thread_placement *get_placement() const {
+        return this->opts.threaded ? &this->placement : nullptr;
+    }
+};
+
+/* Group commit: jobs of several capuches are collected, then charged to the
+ * disk as one vectored job and all of them finish together. A group goes
+ * once it holds max_bytes, or by poll() once its oldest job waited window.
+ * No thread of its own: capuch steps poll, so a manual clock stays
+ * deterministic. */
+class group_commit {
+  public:
+    /* One disk operation for jobs jobs of bytes bytes in total */
+    typedef std::function<sim_clock::time_point(long bytes, long jobs)>
+        submit_fn;
+
+    struct {
+        std::atomic_ulong groups = 0;
+        std::atomic_ulong jobs = 0;
+        std::atomic_ulong bytes = 0;
+    } stats;
+
+  private:
+    submit_fn submit;
+    std::chrono::nanoseconds window;
+    long max_bytes;
+
+    std::mutex guard;
+    std::vector<flush_job *> pending;
+    long pending_bytes = 0;
+    sim_clock::time_point oldest;
+    std::atomic_bool empty{true}; /* Spares poll() the guard */
+
+    void commit(std::unique_lock<std::mutex> &lk);
+
+  public:
+    group_commit(submit_fn submit, std::chrono::nanoseconds window,
+                 long max_bytes)
+        : submit(submit), window(window), max_bytes(max_bytes) {}
+
+    /* job->bytes must be set. Commits right away if the group is full. */
+    void push(flush_job *job, sim_clock::time_point now);
+    /* Commit the group if its oldest job waited long enough */
+    void poll(sim_clock::time_point now);
+    /* Commit the group now, whatever is in it */
+    void flush();
+};
+
+/* Check every record of a flush file, return the number of bad ones or -1 if
+ * the file could not be read at all. Details go to os. */
+long flush_verify(const std::string &path, std::ostream &os);
+
+/* Single core throughput of the checksum kernels and the compressor */
+void flush_bench(std::ostream &os);
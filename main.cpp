@@ -1,46 +1,155 @@
+#include "affinity.hpp"
+#include "checkpoint.hpp"
+#include "clock.hpp"
+#include "coord.hpp"
+#include "disk_model.hpp"
+#include "donate.hpp"
+#include "flush.hpp"
+#include "metrics.hpp"
 #include "ncctx.hpp"
+#include "produce.hpp"
+#include "scenario.hpp"
+#include "shm.hpp"
+#include "spill.hpp"
 
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <set>
 #include <sstream>
 #include <thread>
+#include <typeinfo>
 #include <vector>
 
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
 class disk_sim {
     friend class view;
+    friend class simulation;
 
   public:
+    /* Set by the UI while the disk thread runs, hence atomic */
     struct disk_conf {
-        long consume_per_second = 32;
+        std::atomic_long consume_per_second = 32;
+        std::atomic_long compress = 0;
+        std::atomic_long checksum = 0;   /* checksum_algo */
+        std::atomic_long spill_bufs = 0; /* Overflow file slots, 0 to drop */
+        std::atomic_long spill_drain_ms = 100; /* Drain while backlog below */
+        std::atomic_long op_cost_us = 0;   /* Fixed cost of each disk op */
+        std::atomic_long group_commit = 0; /* Coalesce capuches' flushes */
+        std::atomic_long group_window_ms = 5;  /* Max wait for a group */
+        std::atomic_long group_max_bufs = 256; /* Group full with that many */
+        std::atomic_long jitter_dist = 0;      /* latency_dist, of each job */
+        std::atomic_long jitter_us = 0; /* Mean extra service time per job */
+        std::atomic_long jitter_shape_pct = 150;
+        std::atomic_long stall_every_ms = 0; /* Scheduled stalls, 0 for none */
+        std::atomic_long stall_rate_per_min = 0; /* Random ones */
+        std::atomic_long stall_ms = 0;           /* Length of either */
+        /* Queued jobs for full bandwidth, 0 any */
+        std::atomic_long qd_saturation = 0;
     } & conf;
 
+    struct {
+        sharded_counter ops;
+        sharded_counter cas_retries; /* On expected_finish */
+        sharded_counter stalls;      /* Jobs that waited one out */
+        histogram service;           /* Start to finish of each job */
+    } stats;
+    disk_model model; /* Load a trace before any job */
+
   private:
-    std::atomic<std::chrono::steady_clock::time_point> expected_finish;
+    sim_clock &clk;
+    long unit; /* Bytes of one job, i.e. of a buffer */
+    std::atomic<sim_clock::time_point> expected_finish;
+    std::atomic_ulong seq{0}; /* Of jobs, picks their jitter */
+    /* Of the last flush(), jobs started by then finish by then. Each capuch
+     * applies it to its own flushes, see capuch::step(). */
+    std::atomic<sim_clock::time_point> flushed{sim_clock::time_point::min()};
 
   public:
-    disk_sim(disk_conf &conf)
-        : conf(conf), expected_finish(std::chrono::steady_clock::now()) {}
+    disk_sim(disk_conf &conf, sim_clock &clk, long unit)
+        : conf(conf), clk(clk), unit(unit), expected_finish(clk.now()) {}
+
+    sim_clock::time_point add_jobs(int count) {
+        return this->add(std::chrono::nanoseconds(
+            1000000000UL * count / this->conf.consume_per_second));
+    }
+
+    /* Everything queued done now, for the disk-flush command. Any thread. */
+    void flush() {
+        auto now = this->clk.now();
+        this->expected_finish.store(now);
+        this->flushed.store(now);
+    }
+    sim_clock::time_point last_flush() const {
+        return this->flushed.load(std::memory_order_relaxed);
+    }
 
-    std::chrono::steady_clock::time_point add_jobs(int count) {
-        auto excpected_duration = std::chrono::nanoseconds(
-            1000000000UL * count / this->conf.consume_per_second);
+    /* Write queue length, zero if idle */
+    std::chrono::nanoseconds backlog() const {
+        return std::max(std::chrono::nanoseconds(0),
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            this->expected_finish.load() - this->clk.now()));
+    }
+
+    /* Partial jobs, e.g. compressed buffers */
+    sim_clock::time_point add_bytes(long bytes) {
+        return this->add(std::chrono::nanoseconds(
+            1000000000UL * bytes /
+            (this->conf.consume_per_second * this->unit)));
+    }
+
+  private:
+    sim_clock::time_point add(std::chrono::nanoseconds excpected_duration) {
+        auto now = this->clk.now();
+        excpected_duration += std::chrono::microseconds(this->conf.op_cost_us);
+        excpected_duration += std::chrono::nanoseconds(this->model.jitter_ns(
+            this->conf.jitter_dist, this->conf.jitter_us,
+            this->conf.jitter_shape_pct,
+            this->seq.fetch_add(1, std::memory_order_relaxed)));
+        this->stats.ops++;
         while (1) {
             auto prev_expected_finish = this->expected_finish.load();
+            auto start =
+                prev_expected_finish < now ? now : prev_expected_finish;
+            /* A stall holds off jobs that would start in it */
+            auto stalled = sim_clock::time_point(
+                std::chrono::nanoseconds(disk_model::stall_end(
+                    start.time_since_epoch().count(),
+                    this->conf.stall_every_ms, this->conf.stall_rate_per_min,
+                    this->conf.stall_ms)));
+            /* Jobs queued ahead of this one, about */
+            long depth = 1 + (prev_expected_finish - now) /
+                                 std::max(excpected_duration,
+                                          std::chrono::nanoseconds(1));
             auto new_expected_finish =
-                (prev_expected_finish < std::chrono::steady_clock::now()
-                     ? std::chrono::steady_clock::now()
-                     : prev_expected_finish) +
-                excpected_duration;
+                stalled + std::chrono::nanoseconds(disk_model::at_depth(
+                              excpected_duration.count(), depth,
+                              this->conf.qd_saturation));
             if (this->expected_finish.compare_exchange_strong(
                     prev_expected_finish, new_expected_finish)) {
+                if (stalled != start)
+                    this->stats.stalls++;
+                this->stats.service.observe(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        new_expected_finish - stalled)
+                        .count());
                 return new_expected_finish;
             }
+            this->stats.cas_retries++;
         }
     }
 };
@@ -48,39 +157,1073 @@ class disk_sim {
 struct resource {
     int id;
     int batch_id;
+    long used; /* Bytes written, once ready */
 };
 
 class pool {
     friend class view;
 
   public:
+    /* Read live by the capuches while the UI and the coord thread set it */
     struct pool_conf {
-        long total_rsc = 1000;
-        long flush_size = 8;
-        long flush_timeout_ns = 2000000000UL;
-        long min_greed = 1;
-        long max_greed = 20;
-        long min_bufs = 2;
-        long reserve = 100;
+        std::atomic_long total_rsc = 1000;
+        /* Room to grow total_rsc to, 0 is 4 times it */
+        std::atomic_long max_rsc = 0;
+        std::atomic_long shards = 1; /* Free lists, 0 is one per numa node */
+        /* Spare buffers go to peers before the pool */
+        std::atomic_long donate = 1;
+        std::atomic_long flush_size = 8;
+        std::atomic_long flush_timeout_ns = 2000000000UL;
+        std::atomic_long flush_depth = 1; /* Batches in flight per capuch */
+        std::atomic_long min_greed = 1;
+        std::atomic_long max_greed = 20;
+        /* 0 one step at a time, 1 from EWMA rates */
+        std::atomic_long greed_ctl = 0;
+        std::atomic_long greed_headroom_pct = 25; /* Of the EWMA controller */
+        std::atomic_long min_bufs = 2;
+        std::atomic_long reserve = 100;
+        std::atomic_long buf_size = 4096;
     } & conf;
 
+    /* Everything the capuches share through the pool, in one mapping: this
+     * header, the free rings, the owner of each buffer and the buffers arena.
+     * Either private to the process, or a named POSIX shared memory object
+     * several processes attach to, each with its own capuches. Buffers move
+     * between processes by id only, the data stays in place.
+     * The arena is laid out for max_rsc buffers, only ids below total_rsc are
+     * in use, the rest are retired and their pages never touched (or given
+     * back), see resize().
+     * Free buffers are split between shards, each with its own guard and
+     * ring, a capuch takes and gives back through its home shard. Pressure
+     * stays global, so quotas are the same whatever the number of shards.
+     * The reserve left out of every quota is not in the rings but in a
+     * lock-free stack of its own, for capuches about to lose data.
+     * Capuches belong to tenant groups, a tree with the root holding all
+     * of the pool. A group's buffers go to its subgroups by weight and the
+     * greed/pressure split runs within each, see regroup(). */
+    struct shared {
+        static constexpr unsigned magic_value = 0xcab0cc;
+        static constexpr int max_procs = 64;
+        static constexpr int max_shards = 16;
+        static constexpr int max_groups = 32;
+
+        std::atomic_uint magic;
+        std::atomic_long total_rsc; /* Changed under every guard */
+        long max_rsc, reserve, buf_size, nshards;
+        size_t ring_off, next_off, owner_off, home_off, arena_off, size;
+
+        struct run_t {
+            pool_mutex guard; /* Procs, reap, resize. Before shard guards */
+            /* Bumped after any change quotas depend on: pressures, size */
+            alignas(cache_line) std::atomic_ulong epoch;
+            /* Pressure of all capuches of each process in each group
+             * (not counting subgroups), lock-free. Each process only adds to
+             * its own, so a crash in the middle of an update leaves nothing
+             * to repair, the totals are their sums. */
+            struct {
+                std::atomic_int pid; /* 0 if the slot is unused */
+                std::atomic_ulong pressure[max_groups];
+                std::atomic_long lent; /* Reserve buffers its capuches hold */
+                std::atomic_int in_reserve; /* Threads in a reserve_gate */
+            } procs[max_procs];
+        } run;
+
+        /* Added under every guard, never removed. A parent's index is below
+         * its children's, the root is 0. */
+        struct group_t {
+            std::atomic_int parent;
+            std::atomic_long weight; /* Against its sibling groups */
+            char name[16];
+        } groups[max_groups];
+        std::atomic_int ngroups;
+        std::atomic_long last_reap_ns;
+
+        /* Apart from each other, each bounces between its lock holders */
+        struct alignas(cache_line) shard_t {
+            pool_mutex guard;
+            long free_head, free_count; /* FIFO ring of free buffer ids */
+            std::atomic_long free;      /* free_count, for lock-free readers */
+            std::atomic_ulong locks_taken;
+            std::atomic_ulong steals; /* Bulk takes by other shards' capuches */
+            std::atomic_ulong stolen; /* Buffers they took */
+        } shards[max_shards];
+
+        /* Treiber stack of the reserve, linked through next[]. The head
+         * carries a tag bumped by every change against ABA. */
+        struct alignas(cache_line) emergency_t {
+            std::atomic_uint64_t head; /* Tag << 32 | top id + 1, 0 empty */
+            std::atomic_long count;
+            std::atomic_long low_since_ns; /* Below target since, 0 if not */
+            std::atomic_bool frozen;       /* By recover_reserve() */
+            histogram refill_latency;      /* Until back to target */
+        } emergency;
+
+        struct stats_t {
+            sharded_counter locks_taken;
+            sharded_counter bufs_lost;
+            sharded_counter bufs_recovered; /* From crashed processes */
+            sharded_counter reserve_hits;   /* Buffers saved by the reserve */
+            sharded_counter reserve_misses; /* Found it empty */
+        } stats;
+
+        /* Copies of run fields for lock-free readers (metrics exporter) */
+        struct published_t {
+            std::atomic_ulong total_pressure;
+            std::atomic_long free;
+        } published;
+
+        void layout(long total_rsc, long max_rsc, long nshards,
+                    long buf_size) {
+            auto align = [](size_t off, size_t a) {
+                return (off + a - 1) / a * a;
+            };
+            this->total_rsc = total_rsc;
+            this->max_rsc = max_rsc;
+            this->nshards = nshards;
+            this->buf_size = buf_size;
+            /* A ring per shard, each big enough for every buffer */
+            this->ring_off = align(sizeof(shared), alignof(int));
+            this->next_off = this->ring_off + nshards * max_rsc * sizeof(int);
+            this->owner_off = this->next_off + max_rsc * sizeof(int);
+            this->home_off = this->owner_off + max_rsc;
+            this->arena_off = align(this->home_off + max_rsc, 4096);
+            this->size = this->arena_off + max_rsc * buf_size;
+        }
+    };
+
+  private:
+    std::unique_ptr<shm_segment> seg;
+    std::string error;
+    int *ring;
+    std::atomic_int *next; /* Below each id on the reserve stack, -1 last */
+    /* Proc slot holding each buffer, or one of the below. Set without
+     * guards by the reserve stack calls, relaxed: the guards or the reserve
+     * gate order what depends on it. */
+    std::atomic<signed char> *owner;
+    static constexpr signed char owner_free = -1;
+    static constexpr signed char owner_retired = -2;  /* Id >= total_rsc */
+    static constexpr signed char owner_reserved = -3; /* On the stack */
+    static_assert(std::atomic<signed char>::is_always_lock_free &&
+                  sizeof(std::atomic<signed char>) == 1);
+    signed char *home; /* Shard whose ring a free buffer is in */
+    char *arena;
+    int slot; /* Of this process in run.procs */
+    shared *sh;
+
+    signed char owner_of(long id) const {
+        return this->owner[id].load(std::memory_order_relaxed);
+    }
+    void set_owner(long id, signed char s) {
+        this->owner[id].store(s, std::memory_order_relaxed);
+    }
+
+    /* Per process, see share() */
     struct {
-        std::atomic_int locks_taken = 0;
-        std::atomic_int bufs_lost = 0;
-    } stats;
+        std::mutex writer;
+        seqlock lock;
+        std::atomic_ulong epoch{~0UL}; /* Worked out as of */
+        std::array<std::atomic_ulong, shared::max_groups> pressure, own;
+        std::array<std::atomic_long, shared::max_groups> budget, own_budget;
+    } groups_cache;
 
   public:
-    struct {
-        std::mutex guard;
-        std::list<resource> free;
-        unsigned long total_pressure = 0;
-    } run;
+    shared::run_t &run;
+    shared::stats_t &stats;
+    shared::published_t &published;
+
+  private:
+    shared *map(const std::string &shm_name) {
+        shared layout;
+        long total = this->conf.total_rsc, max = this->conf.max_rsc;
+        long shards = this->conf.shards;
+        layout.layout(total, std::max(total, max ? max : 4 * total),
+                      std::clamp(shards ? shards : (long)numa_nodes(), 1L,
+                                 (long)shared::max_shards),
+                      this->conf.buf_size);
+
+        shared *sh = nullptr;
+        if (!shm_name.empty()) {
+            this->seg = std::make_unique<shm_segment>();
+            if (!this->seg->map_shared(shm_name, layout.size))
+                this->error =
+                    "cannot map " + shm_name + ": " + strerror(errno);
+            else if (this->seg->is_creator())
+                sh = this->init(layout);
+            else
+                sh = this->attach();
+        }
+        if (!sh) {
+            /* Private, or fall back to it if shared did not work out */
+            this->seg = std::make_unique<shm_segment>();
+            bool ok = this->seg->map_private(layout.size);
+            assert(ok);
+            (void)ok;
+            sh = this->init(layout);
+        }
+
+        this->set_pointers(sh);
+        return sh;
+    }
+
+    shared *init(const shared &layout) {
+        auto sh = new (this->seg->get()) shared();
+        sh->layout(layout.total_rsc, layout.max_rsc, layout.nshards,
+                   layout.buf_size);
+        sh->reserve = this->conf.reserve;
+        sh->run.guard.init(this->seg->is_shared());
+        for (int k = 0; k < sh->nshards; ++k)
+            sh->shards[k].guard.init(this->seg->is_shared());
+        sh->groups[0].weight = 1;
+        sh->ngroups = 1;
+        this->set_pointers(sh);
+        /* The reserve first, the rest dealt round robin */
+        long reserved = std::clamp(sh->reserve, 0L, sh->total_rsc.load());
+        for (int i = 0; i < sh->max_rsc; ++i) {
+            if (i < reserved)
+                this->push_reserve(i);
+            else if (i < sh->total_rsc)
+                this->give(i % sh->nshards, {.id = i});
+            else
+                this->set_owner(i, owner_retired);
+        }
+        sh->published.free = sh->total_rsc - reserved;
+        sh->magic.store(shared::magic_value, std::memory_order_release);
+        return sh;
+    }
+
+    shared *attach() {
+        auto sh = (shared *)this->seg->get();
+        for (int i = 0; i < 100; ++i) {
+            if (sh->magic.load(std::memory_order_acquire) ==
+                shared::magic_value)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (sh->magic.load(std::memory_order_acquire) != shared::magic_value ||
+            sh->size > this->seg->get_size()) {
+            this->error = this->seg->get_name() + " is not a pool";
+            return nullptr;
+        }
+
+        /* The creator's configuration wins */
+        this->conf.total_rsc = sh->total_rsc.load();
+        this->conf.max_rsc = sh->max_rsc;
+        this->conf.shards = sh->nshards;
+        this->conf.reserve = sh->reserve;
+        this->conf.buf_size = sh->buf_size;
+        return sh;
+    }
+
+    void set_pointers(shared *sh) {
+        this->sh = sh;
+        this->ring = (int *)((char *)sh + sh->ring_off);
+        this->next = (std::atomic_int *)((char *)sh + sh->next_off);
+        this->owner =
+            (std::atomic<signed char> *)((char *)sh + sh->owner_off);
+        this->home = (signed char *)sh + sh->home_off;
+        this->arena = (char *)sh + sh->arena_off;
+    }
+
+    /* The groups cache from the procs' pressures, its writer lock held. A
+     * group's budget goes to its subgroups with any pressure by weight, its
+     * own capuches count as one more subgroup of weight 1: groups with
+     * nothing running lend theirs to the others. With the root alone this
+     * is the flat split of old. */
+    void regroup() {
+        constexpr int max = shared::max_groups;
+        auto &c = this->groups_cache;
+        unsigned long epoch = this->epoch();
+        int n = this->sh->ngroups.load(std::memory_order_acquire);
+        unsigned long own[max] = {}, pressure[max];
+        long weights[max] = {}; /* Of the members with pressure */
+        long budget[max], own_budget[max];
+        auto parent = [this](int g) {
+            return this->sh->groups[g].parent.load(std::memory_order_relaxed);
+        };
+        for (int s = 0; s < shared::max_procs; ++s)
+            for (int g = 0; g < n; ++g)
+                own[g] += this->run.procs[s].pressure[g].load(
+                    std::memory_order_relaxed);
+        for (int g = 0; g < n; ++g)
+            pressure[g] = own[g];
+        for (int g = n - 1; g > 0; --g)
+            pressure[parent(g)] += pressure[g];
+        for (int g = 0; g < n; ++g) {
+            weights[g] += !!own[g];
+            if (g && pressure[g])
+                weights[parent(g)] += this->sh->groups[g].weight;
+        }
+        for (int g = 0; g < n; ++g) {
+            if (!g)
+                budget[g] = std::max(0L, this->size() - this->conf.reserve);
+            else if (pressure[g])
+                budget[g] = budget[parent(g)] * this->sh->groups[g].weight /
+                            weights[parent(g)];
+            else
+                budget[g] = 0;
+            own_budget[g] = own[g] ? budget[g] / weights[g] : 0;
+        }
+
+        c.lock.write_begin();
+        for (int g = 0; g < n; ++g) {
+            c.pressure[g].store(pressure[g], std::memory_order_relaxed);
+            c.own[g].store(own[g], std::memory_order_relaxed);
+            c.budget[g].store(budget[g], std::memory_order_relaxed);
+            c.own_budget[g].store(own_budget[g], std::memory_order_relaxed);
+        }
+        c.epoch.store(epoch, std::memory_order_relaxed);
+        c.lock.write_end();
+    }
+
+    void clear_slot(int s) {
+        for (auto &pressure : this->run.procs[s].pressure)
+            pressure = 0;
+        this->run.procs[s].lent = 0;
+        this->run.procs[s].in_reserve = 0;
+    }
+
+    /* Return everything proc slot s holds. Must be called with every guard
+     * held, see lock_all() */
+    long release(int s) {
+        long n = 0;
+        for (int id = 0; id < this->sh->max_rsc; ++id) {
+            if (this->owner_of(id) == s) {
+                this->give(id % this->sh->nshards, {.id = id});
+                ++n;
+            }
+        }
+        this->clear_slot(s);
+        this->run.procs[s].pid = 0;
+        this->touch();
+        this->publish();
+        return n;
+    }
+
+    /* Release slots of dead processes. Must be called with every guard held */
+    long reap() {
+        long n = 0;
+        bool dead = false;
+        for (int s = 0; s < shared::max_procs; ++s) {
+            pid_t pid = this->run.procs[s].pid;
+            if (pid && s != this->slot && kill(pid, 0) && errno == ESRCH) {
+                n += this->release(s);
+                dead = true;
+            }
+        }
+        if (dead)
+            n += this->recover_reserve();
+        this->stats.bufs_recovered += n;
+        return n;
+    }
+
+    /* Ids a dead process took off the reserve stack without claiming them
+     * yet, or marked reserved without pushing them yet, back to the rings.
+     * Every guard held, dead slots cleared. The gated lock-free calls of
+     * live processes are waited out first, then the stack stands still: an
+     * id marked reserved is either on it or lost. Returns how many. */
+    long recover_reserve() {
+        auto &e = this->sh->emergency;
+        e.frozen.store(true);
+        for (auto &proc : this->run.procs)
+            while (proc.pid && proc.in_reserve.load())
+                std::this_thread::yield();
+        std::vector<char> stacked(this->sh->max_rsc);
+        auto ids = this->reserve_ids();
+        for (int id : ids)
+            stacked[id] = 1;
+        long n = 0;
+        for (int id = 0; id < this->sh->max_rsc; ++id) {
+            if (this->owner_of(id) == owner_reserved && !stacked[id]) {
+                this->give(id % this->sh->nshards, {.id = id});
+                ++n;
+            }
+        }
+        /* Off by those popped or pushed between the exchange and the count */
+        e.count.store((long)ids.size(), std::memory_order_relaxed);
+        e.frozen.store(false);
+        return n;
+    }
+
+    /* Held by the reserve calls made without guards, so recover_reserve()
+     * can tell their half done pushes and pops from a dead process's */
+    class reserve_gate {
+        pool &p;
+
+      public:
+        reserve_gate(pool &p) : p(p) {
+            auto &in = p.run.procs[p.slot].in_reserve;
+            for (;;) {
+                in.fetch_add(1);
+                if (!p.sh->emergency.frozen.load())
+                    return;
+                in.fetch_sub(1);
+                while (p.sh->emergency.frozen.load(std::memory_order_relaxed))
+                    std::this_thread::yield();
+            }
+        }
+        ~reserve_gate() {
+            p.run.procs[p.slot].in_reserve.fetch_sub(1,
+                                                     std::memory_order_release);
+        }
+    };
+
+    /* The previous owner of shard k's guard died in the middle of something.
+     * Its ring is rebuilt from the per buffer owners and homes, which are
+     * updated before it. */
+    void repair(int k) {
+        auto &shard = this->sh->shards[k];
+        auto ring = this->ring + k * this->sh->max_rsc;
+        shard.free_head = shard.free_count = 0;
+        for (int id = 0; id < this->sh->max_rsc; ++id) {
+            if (this->owner_of(id) != owner_free || this->home[id] != k)
+                continue;
+            if (id < this->sh->total_rsc)
+                ring[shard.free_count++] = id;
+            else
+                this->retire(id);
+        }
+        shard.free = shard.free_count;
+    }
+
+    /* The previous run.guard owner died in the middle of something, every
+     * guard held. Buffers and pressure of dead processes are freed, with
+     * the reserve ids they lost, the rings rebuilt from the per buffer
+     * owners. */
+    void repair() {
+        bool dead = false;
+        for (int s = 0; s < shared::max_procs; ++s) {
+            pid_t pid = this->run.procs[s].pid;
+            if (pid && s != this->slot && kill(pid, 0) && errno == ESRCH) {
+                for (int id = 0; id < this->sh->max_rsc; ++id) {
+                    if (this->owner_of(id) == s) {
+                        this->set_owner(id, owner_free);
+                        this->home[id] = id % this->sh->nshards;
+                        this->stats.bufs_recovered++;
+                    }
+                }
+                this->clear_slot(s);
+                this->run.procs[s].pid = 0;
+                dead = true;
+            }
+        }
+        for (int k = 0; k < this->sh->nshards; ++k)
+            this->repair(k);
+        if (dead)
+            this->stats.bufs_recovered += this->recover_reserve();
+        this->touch();
+        this->publish();
+    }
+
+    /* run.guard, then every shard guard in order */
+    struct all_locks {
+        std::unique_lock<pool_mutex> run;
+        std::vector<std::unique_lock<pool_mutex>> shards;
+    };
+    all_locks lock_all() {
+        all_locks lk;
+        lk.run = std::unique_lock<pool_mutex>(this->run.guard);
+        bool died = this->run.guard.owner_died();
+        for (int k = 0; k < this->sh->nshards; ++k)
+            lk.shards.push_back(this->lock(k));
+        if (died)
+            this->repair();
+        return lk;
+    }
+
+  public:
+    pool(pool_conf &conf, const std::string &shm_name = "")
+        : conf(conf), sh(this->map(shm_name)), run(sh->run),
+          stats(sh->stats), published(sh->published) {
+        this->slot = -1;
+        /* Whatever was left by crashed processes of this or a previous run */
+        auto lk = this->lock_all();
+        this->reap();
+        for (int s = 0; s < shared::max_procs && this->slot < 0; ++s) {
+            if (!this->run.procs[s].pid) {
+                this->run.procs[s].pid = getpid();
+                this->clear_slot(s);
+                this->slot = s;
+            }
+        }
+        if (this->slot < 0)
+            this->error = this->seg->get_name() + ": " +
+                          std::to_string(shared::max_procs) +
+                          " processes attached already";
+    }
+    /* Attached to shm_name if it can, else private with get_error() set,
+     * the same as when the segment is not a pool */
+    static pool *open(pool_conf &conf, const std::string &shm_name) {
+        auto p = new pool(conf, shm_name);
+        if (p->slot >= 0)
+            return p;
+        std::string error = p->error;
+        delete p;
+        p = new pool(conf);
+        p->error = error;
+        return p;
+    }
+
+    ~pool() {
+        if (this->slot < 0)
+            return; /* Refused, it never counted as attached */
+        auto lk = this->lock_all();
+        this->reap();
+        this->release(this->slot);
+        bool last = true;
+        for (int s = 0; s < shared::max_procs; ++s)
+            last &= !this->run.procs[s].pid;
+        if (last)
+            this->seg->unlink();
+    }
+
+    /* Same for every process, unlike the simulated clocks */
+    static long monotonic_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
 
-    pool(pool_conf &conf) : conf(conf) {
-        std::unique_lock<std::mutex> lk(this->run.guard);
-        for (int i = 0; i < this->conf.total_rsc; ++i) {
-            this->run.free.push_back({.id = i});
+    /* Takes shard k's guard, repairs it if its previous owner died */
+    std::unique_lock<pool_mutex> lock(int k) {
+        auto &shard = this->sh->shards[k];
+        std::unique_lock<pool_mutex> lk(shard.guard);
+        if (shard.guard.owner_died())
+            this->repair(k);
+        shard.locks_taken.fetch_add(1, std::memory_order_relaxed);
+        return lk;
+    }
+
+    /* Called often by every capuch. Shared only: once a second (across all
+     * processes) returns buffers and pressure of crashed processes. */
+    void maintain() {
+        if (!this->seg->is_shared())
+            return;
+        long now = monotonic_ns();
+        long last = this->sh->last_reap_ns.load(std::memory_order_relaxed);
+        if (now - last >= 1000000000L &&
+            this->sh->last_reap_ns.compare_exchange_strong(last, now)) {
+            auto lk = this->lock_all();
+            this->reap();
+        }
+    }
+
+    /* Grow or shrink to n buffers, at most capacity(), at once for every
+     * process attached. Growing puts retired ids back in the free rings, the
+     * arena does not move. Shrinking retires the free buffers above n right
+     * away and the ones held by capuches as they give them back, the lower
+     * total_rsc lowers every quota meanwhile. The reserve is emptied into
+     * the rings either way, refill_reserve() takes it back at the new size.
+     * Returns the new size. */
+    long resize(long n) {
+        n = std::clamp(n, 1L, this->sh->max_rsc);
+        auto lk = this->lock_all();
+        this->stats.locks_taken++;
+        long old = this->sh->total_rsc;
+        this->sh->total_rsc = n;
+        this->touch();
+        for (int id; (id = this->pop_reserve()) >= 0;)
+            this->give(id % this->sh->nshards, {.id = id});
+        if (n > old) {
+            for (long id = old; id < n; ++id)
+                if (this->owner_of(id) == owner_retired)
+                    this->give(id % this->sh->nshards, {.id = (int)id});
+        } else if (n < old) {
+            long max = this->sh->max_rsc;
+            for (int k = 0; k < this->sh->nshards; ++k) {
+                auto &shard = this->sh->shards[k];
+                auto ring = this->ring + k * max;
+                long kept = 0;
+                for (long i = 0; i < shard.free_count; ++i) {
+                    int id = ring[(shard.free_head + i) % max];
+                    if (id < n)
+                        ring[(shard.free_head + kept++) % max] = id;
+                    else
+                        this->retire(id);
+                }
+                shard.free_count = kept;
+                shard.free = kept;
+            }
+        }
+        this->publish();
+        return n;
+    }
+
+    /* Refresh published after run or a shard was modified. Other shards'
+     * free counts may be a moment old. */
+    void publish() {
+        long free = 0;
+        for (int k = 0; k < this->sh->nshards; ++k)
+            free += this->sh->shards[k].free.load(std::memory_order_relaxed);
+        this->published.total_pressure.store(this->total_pressure(),
+                                             std::memory_order_relaxed);
+        this->published.free.store(free, std::memory_order_relaxed);
+    }
+
+  public: /* Must be called with shard k's guard held */
+    bool free_empty(int k) const { return !this->sh->shards[k].free_count; }
+    resource take(int k) {
+        auto &shard = this->sh->shards[k];
+        assert(shard.free_count);
+        int id = this->ring[k * this->sh->max_rsc + shard.free_head];
+        this->set_owner(id, this->slot);
+        shard.free_head = (shard.free_head + 1) % this->sh->max_rsc;
+        shard.free_count--;
+        shard.free.store(shard.free_count, std::memory_order_relaxed);
+        return {.id = id};
+    }
+    void give(int k, const resource &r) {
+        if (r.id >= this->sh->total_rsc) {
+            this->retire(r.id); /* Pool shrank while we held it */
+            return;
+        }
+        auto &shard = this->sh->shards[k];
+        auto tail = (shard.free_head + shard.free_count) % this->sh->max_rsc;
+        this->ring[k * this->sh->max_rsc + tail] = r.id;
+        this->home[r.id] = k;
+        shard.free_count++;
+        shard.free.store(shard.free_count, std::memory_order_relaxed);
+        this->set_owner(r.id, owner_free);
+    }
+
+  public: /* Without shard guards */
+    /* Free buffers in shard k a moment ago */
+    long free_hint(int k) const {
+        return this->sh->shards[k].free.load(std::memory_order_relaxed);
+    }
+    /* Home shard k ran dry: take up to n buffers at once from the shard with
+     * the most free ones into out. Returns how many. */
+    long steal(int k, long n, std::list<resource> &out) {
+        int victim = -1;
+        long most = 0;
+        for (int v = 0; v < this->sh->nshards; ++v) {
+            auto &shard = this->sh->shards[v];
+            long free = shard.free.load(std::memory_order_relaxed);
+            if (v != k && free > most) {
+                victim = v;
+                most = free;
+            }
         }
+        if (victim < 0)
+            return 0;
+        auto lk = this->lock(victim);
+        this->stats.locks_taken++;
+        long got = 0;
+        for (; got < n && !this->free_empty(victim); ++got)
+            out.push_back(this->take(victim));
+        auto &shard = this->sh->shards[victim];
+        shard.steals.fetch_add(1, std::memory_order_relaxed);
+        shard.stolen.fetch_add(got, std::memory_order_relaxed);
+        this->publish();
+        return got;
+    }
+    void retire(int id) {
+        this->set_owner(id, owner_retired);
+        this->seg->discard(this->sh->arena_off + (long)id * this->sh->buf_size,
+                           this->sh->buf_size);
+    }
+    /* Bring the reserve back to pool_conf.reserve from shard k, or give the
+     * excess to it. Buffers lent out count as in it, they come back through
+     * repay_reserve(). Called often by every capuch: locks only once an
+     * eighth of the reserve is missing and shard k has free buffers to move,
+     * so it refills in batches as pressure drops. */
+    void refill_reserve(int k) {
+        auto &e = this->sh->emergency;
+        long target = this->reserve_target();
+        long count = e.count.load(std::memory_order_relaxed);
+        if (count == target ||
+            (count < target && (target - count < std::max(1L, target / 8) ||
+                                !this->free_hint(k))))
+            return;
+        {
+            auto lk = this->lock(k);
+            this->stats.locks_taken++;
+            for (; count < target && !this->free_empty(k); ++count)
+                this->push_reserve(this->take(k).id);
+            for (int id; count > target && (id = this->pop_reserve()) >= 0;
+                 --count)
+                this->give(k, {.id = id});
+            this->publish();
+        }
+        this->refilled(target);
+    }
+
+  private: /* Lock-free, the reserve stack */
+    void push_reserve(int id) {
+        auto &head = this->sh->emergency.head;
+        this->set_owner(id, owner_reserved);
+        uint64_t top = head.load(std::memory_order_relaxed);
+        uint64_t to;
+        do {
+            this->next[id].store((int)(uint32_t)top - 1,
+                                 std::memory_order_relaxed);
+            to = ((top >> 32) + 1) << 32 | (uint32_t)(id + 1);
+        } while (!head.compare_exchange_weak(top, to,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+        this->sh->emergency.count.fetch_add(1, std::memory_order_relaxed);
+    }
+    /* -1 if empty. next[] of an id popped by someone else meanwhile may be
+     * read, the tag then fails the exchange. */
+    int pop_reserve() {
+        auto &head = this->sh->emergency.head;
+        uint64_t top = head.load(std::memory_order_acquire);
+        while ((uint32_t)top) {
+            int id = (int)(uint32_t)top - 1;
+            int below = this->next[id].load(std::memory_order_relaxed);
+            uint64_t to = ((top >> 32) + 1) << 32 | (uint32_t)(below + 1);
+            if (head.compare_exchange_weak(top, to, std::memory_order_acquire,
+                                           std::memory_order_acquire)) {
+                this->sh->emergency.count.fetch_sub(
+                    1, std::memory_order_relaxed);
+                return id;
+            }
+        }
+        return -1;
+    }
+    /* Stack size wanted, less what capuches borrowed */
+    long reserve_target() const {
+        long reserve = std::clamp(this->conf.reserve.load(), 0L, this->size());
+        return std::max(0L, reserve - this->reserve_lent());
+    }
+    void refilled(long target) {
+        auto &e = this->sh->emergency;
+        if (e.count.load(std::memory_order_relaxed) < target)
+            return;
+        long since = e.low_since_ns.exchange(0);
+        if (since)
+            e.refill_latency.observe(monotonic_ns() - since);
+    }
+
+  public: /* Lock-free */
+    /* A buffer from the reserve for a capuch out of them, without waiting
+     * for any guard: a few exchanges on the stack head at most. The capuch
+     * owns it from then on and gives it back through its quota like any
+     * other. One killed between the pop and setting the owner leaves it
+     * marked reserved, recover_reserve() finds it. */
+    std::optional<resource> grab_reserve() {
+        reserve_gate gate(*this);
+        int id = this->pop_reserve();
+        if (id < 0) {
+            this->stats.reserve_misses++;
+            return {};
+        }
+        this->set_owner(id, this->slot);
+        this->run.procs[this->slot].lent++;
+        this->stats.reserve_hits++;
+        long zero = 0;
+        this->sh->emergency.low_since_ns.compare_exchange_strong(
+            zero, monotonic_ns(), std::memory_order_relaxed);
+        return resource{.id = id};
+    }
+    /* A buffer a capuch has no use for back to the reserve, if short */
+    bool refund_reserve(const resource &r) {
+        reserve_gate gate(*this);
+        long target = this->reserve_target();
+        if (this->reserve_count() >= target || r.id >= this->size())
+            return false;
+        this->push_reserve(r.id);
+        this->refilled(target);
+        return true;
+    }
+    /* A buffer taken with grab_reserve() back to it */
+    void repay_reserve(const resource &r) {
+        reserve_gate gate(*this);
+        this->settle_reserve(1);
+        if (r.id >= this->size()) {
+            this->retire(r.id); /* Pool shrank while we held it */
+            return;
+        }
+        this->push_reserve(r.id);
+        this->refilled(this->reserve_target());
+    }
+    /* n borrowed buffers went back to the pool some other way */
+    void settle_reserve(long n) { this->run.procs[this->slot].lent -= n; }
+    long reserve_lent() const {
+        long n = 0;
+        for (int s = 0; s < shared::max_procs; ++s)
+            n += this->run.procs[s].lent.load(std::memory_order_relaxed);
+        return n;
+    }
+    long reserve_count() const {
+        return this->sh->emergency.count.load(std::memory_order_relaxed);
+    }
+    const histogram &reserve_refill_latency() const {
+        return this->sh->emergency.refill_latency;
+    }
+
+    /* Pressure of a capuch of group g changed by delta (wrapping when
+     * negative) */
+    void add_pressure(int g, unsigned long delta) {
+        this->run.procs[this->slot].pressure[g].fetch_add(
+            delta, std::memory_order_relaxed);
+        this->touch();
+    }
+    unsigned long total_pressure() { return this->share(0).pressure; }
+
+    /* Of group g as of the current epoch. Worked out once per epoch for all
+     * capuches of the process (see regroup()), so that a quota stays a
+     * lookup and a division however deep the group. */
+    struct group_share {
+        unsigned long pressure, own; /* Whole subtree, own capuches only */
+        long budget, own_budget;     /* Buffers for them */
+    };
+    group_share share(int g) {
+        auto &c = this->groups_cache;
+        unsigned long epoch = this->epoch();
+        for (;;) {
+            unsigned seq = c.lock.read_begin();
+            if (c.epoch.load(std::memory_order_relaxed) + 1 > epoch) {
+                group_share rv = {
+                    c.pressure[g].load(std::memory_order_relaxed),
+                    c.own[g].load(std::memory_order_relaxed),
+                    c.budget[g].load(std::memory_order_relaxed),
+                    c.own_budget[g].load(std::memory_order_relaxed)};
+                if (!c.lock.read_retry(seq))
+                    return rv;
+                continue;
+            }
+            std::lock_guard<std::mutex> lk(c.writer);
+            if (c.epoch.load(std::memory_order_relaxed) + 1 <= epoch)
+                this->regroup();
+        }
+    }
+    /* Changes when quotas may have, see capuch::quota() */
+    unsigned long epoch() const {
+        return this->run.epoch.load(std::memory_order_acquire);
+    }
+    void touch() { this->run.epoch.fetch_add(1, std::memory_order_release); }
+
+  public:
+    /* Buffer data, at the same place for every process attached */
+    char *buffer(int id) {
+        return this->arena + (long)id * this->sh->buf_size;
+    }
+    long size() const { return this->sh->total_rsc; }
+    std::vector<long> arena_nodes() const { /* See numa_histogram() */
+        return numa_histogram(this->arena, this->size() * this->sh->buf_size,
+                              this->sh->buf_size);
+    }
+    long capacity() const { return this->sh->max_rsc; }
+    long retiring() const { /* Held ids above size(), racy */
+        long n = 0;
+        for (long id = this->size(); id < this->sh->max_rsc; ++id)
+            n += this->owner_of(id) >= 0;
+        return n;
+    }
+    int nshards() const { return this->sh->nshards; }
+
+    /* Check what every guard protects against the per buffer owners: each
+     * free ring holds distinct ids below size(), owned by nobody and homed
+     * in that ring, and they are all the free ones. Ids below size() are
+     * never retired. Takes every guard, briefly. False with why set on the
+     * first thing wrong. */
+    bool audit(std::string &why) {
+        auto lk = this->lock_all();
+        std::vector<char> seen(this->sh->max_rsc);
+        long in_rings = 0, free = 0;
+        std::stringstream ss;
+        for (int k = 0; k < this->sh->nshards && ss.str().empty(); ++k) {
+            this->audit_ring(k, seen, ss);
+            in_rings += this->sh->shards[k].free_count;
+        }
+        this->audit_retired(ss);
+        for (long id = 0; id < this->sh->max_rsc && ss.str().empty(); ++id)
+            free += this->owner_of(id) == owner_free;
+        if (ss.str().empty() && free != in_rings)
+            ss << free << " ids free but " << in_rings << " in the rings";
+        why = ss.str();
+        return why.empty();
+    }
+    /* The same with shard k's guard only, while the others carry on: its
+     * ring, and no id below size() retired (size() changes under every
+     * guard, ids retire above it). Not whether free ids of other shards
+     * are all in their rings. */
+    bool audit(int k, std::string &why) {
+        auto lk = this->lock(k);
+        std::vector<char> seen(this->sh->max_rsc);
+        std::stringstream ss;
+        this->audit_ring(k, seen, ss);
+        this->audit_retired(ss);
+        why = ss.str();
+        return why.empty();
+    }
+
+  private: /* Of audit(), shard k's guard held. seen: ids in rings so far */
+    void audit_ring(int k, std::vector<char> &seen, std::stringstream &ss) {
+        long max = this->sh->max_rsc, total = this->sh->total_rsc;
+        auto &shard = this->sh->shards[k];
+        if (shard.free_count < 0 || shard.free_count > max ||
+            shard.free != shard.free_count) {
+            ss << "shard " << k << " free_count=" << shard.free_count
+               << " free=" << shard.free;
+            return;
+        }
+        for (long i = 0; i < shard.free_count && ss.str().empty(); ++i) {
+            int id = this->ring[k * max + (shard.free_head + i) % max];
+            if (id < 0 || id >= total || seen[id]++)
+                ss << "shard " << k << " ring has id " << id
+                   << (id >= 0 && id < total ? " twice" : "");
+            else if (this->owner_of(id) != owner_free || this->home[id] != k)
+                ss << "id " << id << " in shard " << k << " ring with owner "
+                   << (int)this->owner_of(id) << " home "
+                   << (int)this->home[id];
+        }
+    }
+    void audit_retired(std::stringstream &ss) {
+        long total = this->sh->total_rsc;
+        for (long id = 0; id < total && ss.str().empty(); ++id)
+            if (this->owner_of(id) == owner_retired)
+                ss << "id " << id << " retired below size " << total;
+    }
+
+  public:
+    /* Ids on the reserve stack, bottom first. Nobody may push or pop. */
+    std::vector<int> reserve_ids() const {
+        std::vector<int> ids;
+        uint64_t top = this->sh->emergency.head.load();
+        for (int id = (int)(uint32_t)top - 1; id >= 0; id = this->next[id])
+            ids.push_back(id);
+        std::reverse(ids.begin(), ids.end());
+        return ids;
+    }
+    /* Back to a checkpoint taken with size total_rsc, before any capuch
+     * of this process runs: the reserve stacked in order, ids taken held by
+     * this process, lent of them from the reserve, the rest below size()
+     * free. Ids are below capacity() and appear once. */
+    void restore(long total_rsc, const std::vector<int> &reserved,
+                 const std::vector<int> &taken, long lent) {
+        auto lk = this->lock_all();
+        this->stats.locks_taken++;
+        for (int k = 0; k < this->sh->nshards; ++k) {
+            auto &shard = this->sh->shards[k];
+            shard.free_head = shard.free_count = 0;
+            shard.free = 0;
+        }
+        while (this->pop_reserve() >= 0)
+            ;
+        this->sh->total_rsc = std::clamp(total_rsc, 1L, this->sh->max_rsc);
+        for (long id = 0; id < this->sh->max_rsc; ++id)
+            if (this->owner_of(id) != owner_retired) /* Pages given back */
+                this->set_owner(id, owner_free);
+        for (int id : reserved)
+            this->push_reserve(id);
+        for (int id : taken)
+            this->set_owner(id, this->slot);
+        for (long id = 0; id < this->sh->max_rsc; ++id) {
+            signed char o = this->owner_of(id);
+            if (o >= 0 || o == owner_reserved)
+                continue;
+            if (id < this->sh->total_rsc)
+                this->give(id % this->sh->nshards, {.id = (int)id});
+            else if (o == owner_free)
+                this->retire(id);
+        }
+        this->run.procs[this->slot].lent = lent;
+        this->touch();
+        this->publish();
+    }
+    /* Pressure this process accounted in group g */
+    unsigned long own_pressure(int g) const {
+        return this->run.procs[this->slot].pressure[g].load(
+            std::memory_order_relaxed);
+    }
+    long lent() const { /* By this process */
+        return this->run.procs[this->slot].lent.load(
+            std::memory_order_relaxed);
+    }
+
+    /* Index of the group at path, e.g. "/web/api" ("/" is the root), added
+     * with weight 1 along with missing parents. -1 if out of groups or a
+     * name is too long. */
+    int group(const std::string &path) {
+        auto lk = this->lock_all();
+        std::stringstream ss(path);
+        std::string name;
+        int g = 0;
+        while (std::getline(ss, name, '/')) {
+            if (name.empty())
+                continue;
+            int n = this->sh->ngroups, child = -1;
+            for (int i = g + 1; i < n && child < 0; ++i)
+                if (this->sh->groups[i].parent == g &&
+                    name == this->sh->groups[i].name)
+                    child = i;
+            if (child < 0) {
+                if (n == shared::max_groups ||
+                    name.size() >= sizeof(shared::group_t::name))
+                    return -1;
+                auto &added = this->sh->groups[n];
+                added.parent = g;
+                added.weight = 1;
+                strcpy(added.name, name.c_str());
+                this->sh->ngroups.store(n + 1, std::memory_order_release);
+                child = n;
+            }
+            g = child;
+        }
+        return g;
+    }
+    void set_group_weight(int g, long weight) {
+        this->sh->groups[g].weight = std::max(1L, weight);
+        this->touch();
+    }
+    long group_weight(int g) const { return this->sh->groups[g].weight; }
+    int ngroups() const {
+        return this->sh->ngroups.load(std::memory_order_acquire);
+    }
+    std::string group_path(int g) const {
+        std::string path;
+        for (; g; g = this->sh->groups[g].parent)
+            path = "/" + std::string(this->sh->groups[g].name) + path;
+        return path.empty() ? "/" : path;
+    }
+    const shared::shard_t &shard(int k) const { return this->sh->shards[k]; }
+    bool is_shared() const { return this->seg->is_shared(); }
+    const std::string &get_name() const { return this->seg->get_name(); }
+    const std::string &get_error() const { return this->error; }
+    int nprocs() const {
+        int n = 0;
+        for (int s = 0; s < shared::max_procs; ++s)
+            n += !!this->run.procs[s].pid;
+        return n;
+    }
+};
+
+/* What the capuch handlers read on every event: greed bounds, flush size,
+ * which greed controller and the time. The generic engine reads the conf as
+ * it is and calls the clock through its vtable. */
+struct generic_engine {
+    const pool::pool_conf &conf;
+    sim_clock &clk;
+
+    long min_greed() const { return this->conf.min_greed; }
+    long max_greed() const { return this->conf.max_greed; }
+    long flush_size() const { return this->conf.flush_size; }
+    bool greed_ctl() const { return this->conf.greed_ctl; }
+    sim_clock::time_point now() const { return this->clk.now(); }
+};
+
+/* The same with the conf as constants, for the compiler to fold bounds and
+ * branches on, and a direct call to the clock. Only steps capuches while
+ * the conf matches, see simulation::pick_engine(). */
+template <long MinGreed, long MaxGreed, long FlushSize, bool GreedCtl,
+          class Clock>
+struct fixed_engine {
+    const pool::pool_conf &conf;
+    sim_clock &clk;
+
+    static constexpr long min_greed() { return MinGreed; }
+    static constexpr long max_greed() { return MaxGreed; }
+    static constexpr long flush_size() { return FlushSize; }
+    static constexpr bool greed_ctl() { return GreedCtl; }
+    sim_clock::time_point now() const {
+        return static_cast<Clock &>(this->clk).Clock::now();
+    }
+
+    static bool matches(const pool::pool_conf &conf, const sim_clock &clk) {
+        return conf.min_greed == MinGreed && conf.max_greed == MaxGreed &&
+               conf.flush_size == FlushSize &&
+               !!conf.greed_ctl == GreedCtl && typeid(clk) == typeid(Clock);
     }
 };
 
@@ -88,136 +1231,496 @@ class capuch {
     friend class view;
     friend class simulation;
 
-  private: /* Internal */
+  private: /* Internal, set up once */
     int id;
     pool &p;
     disk_sim &disk;
+    sim_clock &clk;
+    flush_pipeline *pipe; /* Direct to disk if none */
+    spill_file *spill;    /* Overwrite oldest ready buffers if none */
+    group_commit *group;  /* Own disk job per flush if none */
+    donation_board *board;
+    std::thread thread; /* Running main(), none under a manual clock */
+    /* Running produce_main() with a port, none under a manual clock */
+    std::thread producer;
+    bool threaded_producer = false; /* Set before both start */
+    int shard = 0;      /* Of the pool, takes and gives through it */
+    int box = -1;       /* On the board, -1 if none */
+    long box_want = 0;  /* Our share of its want, see publish() */
+    /* With conf.producer, written through instead of on_ready()'s trace */
+    std::unique_ptr<producer_port> port;
+    std::atomic_int tenant{0};      /* Group in the pool */
+    std::atomic_ulong accounted{0}; /* Tenant << 56 | pressure added for it */
+    thread_placement placement; /* Of the thread, set before it starts */
+
+  public:
+    typedef void (*stepper)(capuch &);
+
+  private:
+    /* step_as() an engine, changed by the UI as the conf does */
+    std::atomic<stepper> engine{&capuch::step_as<generic_engine>};
+
+  public: /* Properties, written by the UI */
+    std::atomic_int priority{10};
+    struct {
+        std::atomic_bool running{true};
+        std::atomic_int ready_per_sec{1};
+    } simulation;
+
+  private: /* Internal, hot: written by the capuch thread only */
+    uint64_t trace_rng;
+    uint64_t trace_seq = 0;
     std::list<resource> free_list;
     std::list<resource> ready_list;
+    std::list<resource> handed; /* Staged in the port, or being written */
     std::optional<resource> active_rsc;
     int batch_size = 0;
     int batch_id = 0;
-    int greed = 0;
+    std::atomic_int greed{0}; /* Also read by set_priority() on the UI */
+    int borrowed = 0; /* From the pool's reserve, paid back once flushed */
+    struct {
+        unsigned long epoch = ~0UL;
+        int value;
+    } quota_cache;
+    /* Of the EWMA greed controller, kept whichever is in use */
+    struct {
+        double fill_per_sec = 0; /* Ready buffers */
+        double fill_gap = 0;     /* Seconds between bursts of them */
+        double flush_sec = 0;    /* Latency of a flush */
+        double set_for = 0;      /* Need greed was last set for */
+    } ewma;
+
+    /* A batch on its way to disk */
+    struct pending_flush {
+        int batch_id;
+        sim_clock::time_point start;
+        sim_clock::time_point finish;   /* max() until the job is submitted */
+        std::unique_ptr<flush_job> job; /* With a pipeline or group only */
+    };
+    /* Up to pool_conf.flush_depth, finishing in any order */
+    std::vector<pending_flush> in_flight;
+    std::vector<std::unique_ptr<flush_job>> spare_jobs;
 
     struct {
-        std::chrono::steady_clock::time_point last_ready;
-        std::chrono::steady_clock::time_point flush_start;
-        std::chrono::steady_clock::time_point flush_finish;
+        sim_clock::time_point now; /* Of the current step, for handlers */
+        sim_clock::time_point last_ready;
+        sim_clock::time_point flush_finish; /* Of the last finished flush */
+        /* disk_sim::flushed applied to in_flight */
+        sim_clock::time_point disk_flushed = sim_clock::time_point::min();
         bool flush_ready;
-        bool flushing;
+        int flushing; /* in_flight.size(), for the view */
     } thread_state;
 
-  public: /* Properties */
-    int priority = 10;
-    struct {
-        bool running = true;
-        int ready_per_sec = 1;
-    } simulation;
-
+  public: /* Hot too */
     struct {
         int greed_inc = 0;
         int greed_dec = 0;
         int timeout = 0;
     } stats;
 
+  public: /* Lock-free snapshot of the above, published by the capuch thread */
+    enum published_field {
+        pub_batch_id,
+        pub_greed,
+        pub_priority,
+        pub_pressure,
+        pub_quota,
+        pub_nbufs,
+        pub_free,
+        pub_ready,
+        pub_in_flight,
+        pub_flush_ready,
+        pub_active, /* Id, -1 if none */
+        pub_greed_inc,
+        pub_greed_dec,
+        pub_timeout,
+        pub_nfields
+    };
+    struct snapshot {
+        seqlock lock;
+        std::array<std::atomic_long, pub_nfields> fields{};
+        histogram flush_latency;
+    };
+
+  private:
+    std::unique_ptr<snapshot> snap = std::make_unique<snapshot>();
+
   private: /* Internal methods */
+    /* Account the current pressure in the pool, no lock. Called by the UI
+     * (priority) as well as the capuch thread (greed): exchanging what was
+     * accounted keeps the pool total the sum of the capuches' own. Moving
+     * to another group takes what was accounted out of the one it went to. */
+    void account_pressure() {
+        int tenant = this->tenant.load(std::memory_order_relaxed);
+        unsigned long now = this->greed ? this->pressure() : 0;
+        unsigned long was =
+            this->accounted.exchange((unsigned long)tenant << 56 | now);
+        int was_tenant = was >> 56;
+        was &= (1UL << 56) - 1;
+        if (was_tenant == tenant) {
+            this->p.add_pressure(tenant, now - was);
+        } else {
+            this->p.add_pressure(was_tenant, -was);
+            this->p.add_pressure(tenant, now);
+        }
+        this->p.publish();
+    }
+    unsigned long accounted_pressure() const {
+        return this->accounted.load(std::memory_order_relaxed) &
+               ((1UL << 56) - 1);
+    }
+    void set_tenant(int g) {
+        this->tenant = g;
+        this->account_pressure();
+    }
     void set_priority(int priority) {
         if (this->greed < this->p.conf.max_greed) {
-            std::unique_lock<std::mutex> lk(this->p.run.guard);
-            if (this->greed)
-                this->p.run.total_pressure -= this->pressure();
-            this->priority = priority;
-            this->p.run.total_pressure += this->pressure();
+            /* greed_for divides the pressure by it */
+            this->priority = std::max(1, priority);
+            this->account_pressure();
         }
     }
-    void inc_greed() {
-        if (this->greed < this->p.conf.max_greed) {
+    template <class E> void inc_greed(const E &e) {
+        if (this->greed < e.max_greed()) {
             this->stats.greed_inc++;
-            std::unique_lock<std::mutex> lk(this->p.run.guard);
-            this->p.stats.locks_taken++;
-            if (this->greed)
-                this->p.run.total_pressure -= this->pressure();
             ++this->greed;
-            if (this->greed < this->p.conf.min_greed)
-                this->greed = this->p.conf.min_greed;
-            this->p.run.total_pressure += this->pressure();
+            if (this->greed < e.min_greed())
+                this->greed = e.min_greed();
+            this->account_pressure();
         }
     }
-    void dec_greed() {
-        if (this->greed > this->p.conf.min_greed) {
+    template <class E> void dec_greed(const E &e) {
+        if (this->greed > e.min_greed()) {
             this->stats.greed_dec++;
-            std::unique_lock<std::mutex> lk(this->p.run.guard);
-            this->p.stats.locks_taken++;
-            if (this->greed)
-                this->p.run.total_pressure -= this->pressure();
             --this->greed;
-            if (this->greed > this->p.conf.max_greed)
-                this->greed = this->p.conf.max_greed;
-            this->p.run.total_pressure += this->pressure();
+            if (this->greed > e.max_greed())
+                this->greed = e.max_greed();
+            this->account_pressure();
+        }
+    }
+    template <class E> void set_greed(const E &e, int greed) {
+        greed = std::clamp(greed, (int)e.min_greed(), (int)e.max_greed());
+        if (greed == this->greed)
+            return;
+        if (greed > this->greed)
+            this->stats.greed_inc++;
+        else
+            this->stats.greed_dec++;
+        this->greed = greed;
+        this->account_pressure();
+    }
+
+    /* EWMA greed controller (pool_conf.greed_ctl 1). Rather than a step per
+     * starvation or timeout, greed goes straight to the lowest level whose
+     * quota covers the need: what fills while a batch is on its way to disk
+     * and until the next burst, plus the batch being filled. It only rises
+     * with the need (or when starved), and only falls when idle or once the
+     * need dropped below 1/h of what greed was set for, to the level that
+     * covers need * h with headroom h. Other capuches moving does not move
+     * it, so there is no chain of reactions around a steady load. */
+    static void ewma_add(double &avg, double sample) {
+        avg = avg ? avg + (sample - avg) / 4 : sample;
+    }
+    template <class E> double greed_need(const E &e) const {
+        return this->ewma.fill_per_sec *
+                   (this->ewma.fill_gap + this->ewma.flush_sec) +
+               e.flush_size();
+    }
+    /* Lowest greed with a quota of need, others' pressure in the group as
+     * it is */
+    template <class E> int greed_for(const E &e, double need) const {
+        auto share = this->p.share(this->tenant);
+        double avail = share.own_budget;
+        if (need >= avail)
+            return e.max_greed();
+        double others = share.own - this->accounted_pressure();
+        if (others <= 0)
+            return e.min_greed();
+        double pressure = need * others / (avail - need);
+        return std::clamp(
+            (int)std::ceil(std::log2(std::max(1.0, pressure / this->priority))),
+            (int)e.min_greed(), (int)e.max_greed());
+    }
+    template <class E> void control_greed(const E &e, bool starved, bool idle) {
+        double need = this->greed_need(e);
+        double headroom = 1 + this->p.conf.greed_headroom_pct / 100.0;
+        int up = this->greed_for(e, need);
+        if (starved)
+            up = std::max(up, this->greed + 1);
+        if (up > this->greed) {
+            this->set_greed(e, up);
+            this->ewma.set_for = need;
+        } else if (idle || need * headroom < this->ewma.set_for) {
+            this->set_greed(e,
+                            std::max(this->greed_for(e, need * headroom), up));
+            this->ewma.set_for = need;
         }
     }
 
+    /* Spare free buffers above quota refill the pool's reserve first, it
+     * takes them without a lock */
+    void refund() {
+        while (!this->free_list.empty() && this->held() > this->quota() &&
+               this->p.refund_reserve(this->free_list.front()))
+            this->free_list.pop_front();
+    }
+    /* Borrowed buffers back to the reserve as they come out of flushes.
+     * Until then the reserve is not refilled for them from the pool, or
+     * every borrowed buffer would be one more than the quotas allow. */
+    void repay() {
+        for (; this->borrowed && !this->free_list.empty(); --this->borrowed) {
+            this->p.repay_reserve(this->free_list.front());
+            this->free_list.pop_front();
+        }
+    }
+    /* Then go to the capuch wanting the most
+     * first, see donation_board */
+    void donate() {
+        long n = std::min((long)this->free_list.size(),
+                          (long)(this->held() - this->quota()));
+        if (this->box < 0 || !this->p.conf.donate || n <= 0)
+            return;
+        auto box = this->board->neediest(this->box);
+        if (!box)
+            return;
+        /* Not those above a shrunk pool, they go back to it to retire */
+        std::vector<resource> shrunk;
+        long given = 0;
+        while (given + (long)shrunk.size() < n && given < box->want.load()) {
+            auto &r = this->free_list.front();
+            if (r.id >= this->p.size())
+                shrunk.push_back(r);
+            else if (!box->push(r.id))
+                break;
+            else
+                ++given;
+            this->free_list.pop_front();
+        }
+        box->want.fetch_sub(given, std::memory_order_relaxed);
+        this->board->release(box);
+        if (given) {
+            this->board->stats.donations++;
+            this->board->stats.donated += given;
+        }
+        this->retire(shrunk);
+    }
+    /* Buffers above a shrunk pool back to it, whatever our quota */
+    void retire(const std::vector<resource> &shrunk) {
+        if (shrunk.empty())
+            return;
+        auto lk = this->p.lock(this->shard);
+        this->p.stats.locks_taken++;
+        for (auto &r : shrunk)
+            this->p.give(this->shard, r);
+        this->p.publish();
+    }
+    /* Buffers donated to us */
+    void collect() {
+        if (this->box < 0)
+            return;
+        auto &box = this->board->get(this->box);
+        long n = 0;
+        for (int id; box.pop(id); ++n)
+            this->free_list.push_back({.id = id});
+        /* Held now, publish() takes them off our shortfall instead */
+        if (n)
+            box.want.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /* Oldest ready buffer no other thread reads: not of a batch a pipeline
+     * or group commit has a job for. end() if none. */
+    std::list<resource>::iterator overwritable() {
+        auto r = this->ready_list.begin();
+        for (; r != this->ready_list.end(); ++r) {
+            bool read = false;
+            for (auto &f : this->in_flight)
+                read |= f.job && f.batch_id == r->batch_id;
+            if (!read)
+                break;
+        }
+        return r;
+    }
+
     void sync_quota() {
-        if (this->quota() < this->nbufs()) {
+        /* Whatever peers donated counts as held from now on, or it would sit
+         * in the mailbox unaccounted once our quota dropped */
+        this->collect();
+        /* Callers check nbufs != quota, but the pool may have moved the
+         * quota since: other threads touch() its epoch at any time */
+        if (this->quota() == this->held())
+            return;
+        if (this->quota() < this->held()) {
+            this->refund();
+            this->donate();
+        }
+
+        if (this->quota() < this->held()) {
             /* Return buffers to the pool */
-            std::unique_lock<std::mutex> lk(this->p.run.guard);
+            auto lk = this->p.lock(this->shard);
             this->p.stats.locks_taken++;
             do {
                 if (!this->free_list.empty()) {
-                    this->p.run.free.push_back(this->free_list.front());
+                    this->p.give(this->shard, this->free_list.front());
                     this->free_list.pop_front();
-                } else if (!this->ready_list.empty()) {
-                    this->p.run.free.push_back(this->ready_list.front());
-                    this->ready_list.pop_front();
-                } else
-                    assert(false); /* We have 0 nbufs, so what, quota < 0? */
-            } while (this->quota() < this->nbufs());
-        } else if (this->quota() > this->nbufs()) {
-            /* Get buffers to the pool */
-            std::unique_lock<std::mutex> lk(this->p.run.guard);
-            this->p.stats.locks_taken++;
-            do {
-                if (this->p.run.free.empty())
+                } else if (auto r = this->overwritable();
+                           r != this->ready_list.end()) {
+                    this->p.give(this->shard, *r);
+                    this->ready_list.erase(r);
+                } else {
+                    /* The rest is with the producer, a flush job or being
+                     * written (a quota of 0, min_bufs 0), else we have 0
+                     * nbufs, so what, quota < 0? */
+                    assert(!this->handed.empty() || this->active_rsc ||
+                           !this->ready_list.empty());
                     break;
-                this->free_list.push_back(this->p.run.free.front());
-                this->p.run.free.pop_front();
-            } while (this->quota() > this->nbufs());
-        } else
-            assert(false); /* Not supposed to call this if nbufs == quota */
+                }
+            } while (this->quota() < this->held());
+            this->p.publish();
+        } else if (this->quota() > this->held()) {
+            /* Get buffers from the pool, the home shard first. Not even
+             * locked when it looks empty, peers may donate meanwhile. */
+            if (this->p.free_hint(this->shard)) {
+                auto lk = this->p.lock(this->shard);
+                this->p.stats.locks_taken++;
+                do {
+                    if (this->p.free_empty(this->shard))
+                        break;
+                    this->free_list.push_back(this->p.take(this->shard));
+                } while (this->quota() > this->held());
+                this->p.publish();
+            }
+            if (this->quota() > this->held())
+                this->p.steal(this->shard, this->quota() - this->held(),
+                              this->free_list);
+        }
     }
 
   public: /* Calculated properties */
-    int nbufs() {
+    int nbufs() const {
         return this->free_list.size() + this->ready_list.size() +
-               this->active_rsc.has_value();
+               this->handed.size() + this->active_rsc.has_value();
     }
+    /* Counted against the quota: not the borrowed ones, or syncing would
+     * give a ready buffer away for each */
+    int held() const { return this->nbufs() - this->borrowed; }
+    /* Cached until the pool's epoch changes: no division (and no shared
+     * line but the epoch's) on the common path. Capuch thread only. */
     int quota() {
-        auto tp = this->p.run.total_pressure;
-        if (!tp)
+        auto epoch = this->p.epoch();
+        if (epoch != this->quota_cache.epoch) {
+            this->quota_cache.value = this->calc_quota();
+            this->quota_cache.epoch = epoch;
+        }
+        return this->quota_cache.value;
+    }
+    /* Out of the group's budget for its own capuches */
+    int calc_quota() const {
+        auto share = this->p.share(this->tenant);
+        if (!share.own)
             return 0;
         return std::max((unsigned long)this->p.conf.min_bufs,
-                        this->pressure() *
-                            (this->p.conf.total_rsc - this->p.conf.reserve) /
-                            tp);
+                        this->pressure() * share.own_budget / share.own);
     }
-    unsigned long pressure() {
+    unsigned long pressure() const {
         return (unsigned long)(1 << this->greed) * this->priority;
     }
+    long flush_depth() const {
+        return std::max(1L, this->p.conf.flush_depth.load());
+    }
+    /* For handlers called off the step */
+    generic_engine generic() const { return {this->p.conf, this->clk}; }
+
+    /* Seqlock protected copy of the published fields, never blocks */
+    std::array<long, pub_nfields> read_snapshot() const {
+        std::array<long, pub_nfields> values;
+        unsigned seq;
+        do {
+            seq = this->snap->lock.read_begin();
+            for (int i = 0; i < pub_nfields; ++i)
+                values[i] =
+                    this->snap->fields[i].load(std::memory_order_relaxed);
+        } while (this->snap->lock.read_retry(seq));
+        return values;
+    }
+    /* Where a producer writes, if any. See producer_port */
+    producer_port *get_port() const { return this->port.get(); }
+    const histogram &flush_latency() const {
+        return this->snap->flush_latency;
+    }
 
   public:
-    capuch(int id, pool &p, disk_sim &disk) : id(id), p(p), disk(disk) {}
+    /* Loop period of main(), also the step of a manually clocked run */
+    static constexpr std::chrono::nanoseconds tick{100000000};
+    /* Buffers staged for a producer, counting the one it writes to */
+    static constexpr size_t stage_depth = 2;
+
+    capuch(int id, pool &p, disk_sim &disk, sim_clock &clk,
+           flush_pipeline *pipe, spill_file *spill, group_commit *group,
+           donation_board *board)
+        : id(id), p(p), disk(disk), clk(clk), pipe(pipe), spill(spill),
+          group(group), board(board),
+          box(board ? board->open() : -1),
+          trace_rng(0x9e3779b97f4a7c15ULL * (id + 1)) {}
+
+  private:
+    /* Synthetic trace records, so the flush stages have something real to
+     * chew on: timestamps, a few event types, counters and some noise. */
+    struct trace_record {
+        uint64_t ts;
+        uint16_t event;
+        uint16_t cpu;
+        uint32_t tid;
+        uint64_t seq;
+        uint64_t arg;
+    };
+    void write_trace(char *dst, long off, sim_clock::time_point now) {
+        trace_record rec;
+        auto &x = this->trace_rng;
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        rec.ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     now.time_since_epoch())
+                     .count() +
+                 off;
+        rec.event = x & 0xf;
+        rec.cpu = this->id & 0x3f;
+        rec.tid = 1000 + this->id;
+        rec.seq = this->trace_seq++;
+        rec.arg = x >> 48;
+        memcpy(dst, &rec, sizeof(rec));
+    }
+    void fill_trace(char *buf, long size) {
+        for (long off = 0; off + (long)sizeof(trace_record) <= size;
+             off += sizeof(trace_record))
+            this->write_trace(buf + off, off, this->thread_state.now);
+    }
+    /* Stands in for a tracer embedding us: a buffer worth of records through
+     * the producer port, each written in place. On the producer thread if
+     * any, the trace state is its own then: on_ready() never runs. */
+    void produce(sim_clock::time_point now) {
+        long n = this->p.conf.buf_size / sizeof(trace_record);
+        for (long i = 0; i < n; ++i) {
+            if (char *dst = this->port->reserve(sizeof(trace_record))) {
+                this->write_trace(dst, i * sizeof(trace_record), now);
+                this->port->commit(sizeof(trace_record));
+            }
+        }
+    }
 
   private: /* Events */
-    void on_ready() {
+    template <class E> void on_ready(const E &e) {
         if (this->active_rsc.has_value()) {
+            if (this->pipe)
+                this->fill_trace(this->p.buffer(this->active_rsc->id),
+                                 this->p.conf.buf_size);
             this->active_rsc->batch_id = this->batch_id;
+            this->active_rsc->used = this->p.conf.buf_size;
             this->ready_list.push_back(*this->active_rsc);
             ++this->batch_size;
             this->active_rsc.reset();
         }
 
         /* Do we need to trigger ready event? */
-        if (this->batch_size >= this->p.conf.flush_size) {
+        if (this->batch_size >= e.flush_size()) {
             this->thread_state.flush_ready = true;
         }
 
@@ -227,11 +1730,14 @@ class capuch {
             this->active_rsc = this->free_list.front();
             this->free_list.pop_front();
         } else {
-            this->inc_greed();
+            if (e.greed_ctl())
+                this->control_greed(e, true, false);
+            else
+                this->inc_greed(e);
             had_to_inc_greed = true;
         }
 
-        if (this->nbufs() != this->quota())
+        if (this->held() != this->quota())
             this->sync_quota();
 
         if (had_to_inc_greed) {
@@ -239,64 +1745,175 @@ class capuch {
                 /* Enought resorces in the free list */
                 this->active_rsc = this->free_list.front();
                 this->free_list.pop_front();
-            } else {
-                assert(this->ready_list.size());
-                this->active_rsc = this->ready_list.front();
-                this->ready_list.pop_front();
+            } else if (auto r = this->p.grab_reserve()) {
+                /* Overwriting or nothing otherwise */
+                this->active_rsc = r;
+                this->borrowed++;
+            } else if (auto r = this->overwritable();
+                       r != this->ready_list.end()) {
+                this->active_rsc = *r;
+                this->ready_list.erase(r);
+                /* Out of the batch to flush next, if it was in it: the disk
+                 * is charged when it is spilled and drained, or not at all */
+                bool charged = this->active_rsc->batch_id != this->batch_id;
+                if (!charged)
+                    --this->batch_size;
 
-                /* Lost data */
+                /* Spilled to the overflow file, or lost data */
+                if (!this->spill ||
+                    !this->spill->spill(this->id, this->active_rsc->batch_id,
+                                        this->p.buffer(this->active_rsc->id),
+                                        this->active_rsc->used, charged,
+                                        this->thread_state.now))
+                    this->p.stats.bufs_lost++;
+                /* Flush. Urgent. */
+                this->thread_state.flush_ready = this->batch_size > 0;
+            } else {
+                /* No buffers at all: a newcomer, other capuches (or, with a
+                 * shared pool, processes) hold all of it until they sync
+                 * their quota. Or all ready ones are being flushed. Lost
+                 * data. */
                 this->p.stats.bufs_lost++;
-                this->thread_state.flush_ready = true; /* Flush. Urgent. */
             }
         }
+    }
 
-        assert(this->active_rsc.has_value());
+    /* Buffers the producer filled, in the order they were handed to it */
+    template <class E> void take_produced(const E &e) {
+        buffer_ring::slot s;
+        while (this->port->take(s)) {
+            assert(s.id == this->handed.front().id);
+            this->handed.pop_front();
+            this->ready_list.push_back(
+                {.id = s.id, .batch_id = this->batch_id, .used = s.used});
+            if (++this->batch_size >= e.flush_size())
+                this->thread_state.flush_ready = true;
+        }
+    }
+    void hand(const resource &r) {
+        this->port->stage(r.id, this->p.buffer(r.id));
+        this->handed.push_back(r);
+    }
+    /* Buffers to keep handed out. A producer thread fills them between our
+     * steps, so that it does not drop records at ready_per_sec. */
+    size_t stage_target() const {
+        if (!this->threaded_producer)
+            return stage_depth;
+        return std::min<size_t>(buffer_ring::capacity,
+                                stage_depth + this->simulation.ready_per_sec *
+                                                  2 * capuch::tick /
+                                                  std::chrono::seconds(1));
+    }
+    /* The counterpart of on_ready() with a producer port: its full buffers
+     * are ready, it is given the next ones to fill. Nothing is overwritten
+     * when out of buffers, the producer drops records instead. */
+    template <class E> void on_produced(const E &e) {
+        this->take_produced(e);
+        if (this->handed.size() < this->stage_target() &&
+            this->free_list.empty()) {
+            if (e.greed_ctl())
+                this->control_greed(e, true, false);
+            else
+                this->inc_greed(e);
+        }
+        if (this->held() != this->quota())
+            this->sync_quota();
+        while (this->handed.size() < this->stage_target() &&
+               !this->free_list.empty()) {
+            this->hand(this->free_list.front());
+            this->free_list.pop_front();
+        }
+        if (this->handed.empty()) {
+            if (auto r = this->p.grab_reserve()) {
+                this->hand(*r);
+                this->borrowed++;
+            }
+        }
     }
 
     void on_flush_start() {
 
-        assert(!this->thread_state.flushing);
         assert(this->thread_state.flush_ready);
         assert(this->batch_size);
 
         this->batch_id++;
         this->thread_state.flush_ready = false;
-        this->thread_state.flushing = true;
-        this->thread_state.flush_start = std::chrono::steady_clock::now();
-        this->thread_state.flush_finish = this->disk.add_jobs(this->batch_size);
+        this->in_flight.push_back({this->batch_id - 1, this->thread_state.now,
+                                   sim_clock::time_point::max(), nullptr});
+        this->thread_state.flushing = this->in_flight.size();
+        auto &f = this->in_flight.back();
+        if (this->pipe || this->group) {
+            /* Finish time is known once the pipeline or group submitted it */
+            if (this->spare_jobs.empty()) {
+                f.job = std::make_unique<flush_job>();
+            } else {
+                f.job = std::move(this->spare_jobs.back());
+                this->spare_jobs.pop_back();
+            }
+            auto job = f.job.get();
+            job->reset();
+            job->buf_size = this->p.conf.buf_size;
+            job->capuch = this->id;
+            job->batch_id = f.batch_id;
+            for (auto &r : this->ready_list)
+                if (r.batch_id == f.batch_id)
+                    job->bufs.push_back({this->p.buffer(r.id), r.used});
+            job->bytes = job->raw_bytes();
+            this->submit(job);
+        } else {
+            f.finish = this->disk.add_jobs(this->batch_size);
+        }
         this->batch_size = 0;
     }
 
-    void on_flush_finish() {
+    void on_flush_finish(size_t i) {
+        auto &f = this->in_flight[i];
+
+        assert(this->thread_state.now >= f.finish);
 
-        assert(std::chrono::steady_clock::now() >=
-               this->thread_state.flush_finish);
-        assert(this->thread_state.flushing);
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           this->thread_state.now - f.start)
+                           .count();
+        this->snap->flush_latency.observe(latency);
+        ewma_add(this->ewma.flush_sec, latency / 1e9);
 
-        auto expected_batch_id = this->batch_id - 1;
-        auto i = this->ready_list.begin();
-        while (i != this->ready_list.end()) {
-            if (i->batch_id == expected_batch_id) {
-                auto r = *i;
-                this->ready_list.erase(i++);
-                this->free_list.push_back(r);
+        /* Anywhere in the ready list, later batches may have finished first
+         * and some of this one may have been taken back by on_ready */
+        std::vector<resource> shrunk;
+        auto r = this->ready_list.begin();
+        while (r != this->ready_list.end()) {
+            if (r->batch_id != f.batch_id) {
+                ++r;
+            } else if (r->id >= this->p.size()) {
+                /* The pool shrank meanwhile, retire it and take another
+                 * on the next sync */
+                shrunk.push_back(*r);
+                r = this->ready_list.erase(r);
             } else
-                break;
+                this->free_list.splice(this->free_list.end(), this->ready_list,
+                                       r++);
         }
+        this->retire(shrunk);
 
-        this->thread_state.flushing = false;
+        this->thread_state.flush_finish = f.finish;
+        if (f.job)
+            this->spare_jobs.push_back(std::move(f.job));
+        this->in_flight.erase(this->in_flight.begin() + i);
+        this->thread_state.flushing = this->in_flight.size();
     }
 
-    void on_timeout() {
-        assert(!this->thread_state.flushing);
+    template <class E> void on_timeout(const E &e) {
+        assert(this->in_flight.empty());
         assert(!this->thread_state.flush_ready);
 
         this->stats.timeout++;
 
-        if (this->free_list.size() > this->ready_list.size())
-            this->dec_greed();
+        if (e.greed_ctl())
+            this->control_greed(e, false, true);
+        else if (this->free_list.size() > this->ready_list.size())
+            this->dec_greed(e);
 
-        if (this->nbufs() > this->quota())
+        if (this->held() > this->quota())
             this->sync_quota();
         /* Important: case nbufs < quota is not handled on timeout. I means that
          * quota gives us more resources than we have. However, since it is
@@ -309,90 +1926,610 @@ class capuch {
         }
     }
 
+    void publish() {
+        /* Same order as published_field */
+        const long values[pub_nfields] = {
+            this->batch_id,
+            this->greed,
+            this->priority,
+            (long)this->pressure(),
+            this->quota(),
+            this->nbufs(),
+            (long)this->free_list.size(),
+            (long)this->ready_list.size(),
+            (long)this->in_flight.size(),
+            this->thread_state.flush_ready,
+            this->active_rsc.has_value() ? this->active_rsc->id : -1,
+            this->stats.greed_inc,
+            this->stats.greed_dec,
+            this->stats.timeout,
+        };
+        this->snap->lock.write_begin();
+        for (int i = 0; i < pub_nfields; ++i)
+            this->snap->fields[i].store(values[i], std::memory_order_relaxed);
+        this->snap->lock.write_end();
+
+        /* What peers with spare buffers may donate */
+        if (this->box >= 0) {
+            long want =
+                this->p.conf.donate
+                    ? std::max(0L, values[pub_quota] - values[pub_nbufs])
+                    : 0;
+            this->board->get(this->box).want.fetch_add(
+                want - this->box_want, std::memory_order_relaxed);
+            this->box_want = want;
+        }
+    }
+
   public: /* Main thread loop */
-    void main() {
-        this->thread_state.last_ready = std::chrono::steady_clock::now();
-        this->thread_state.flush_start = std::chrono::steady_clock::now();
-        this->thread_state.flush_finish = std::chrono::steady_clock::now();
+    void init() {
+        auto now = this->clk.now();
+        this->thread_state.now = now;
+        this->thread_state.last_ready = now;
+        this->thread_state.flush_finish = now;
         this->thread_state.flush_ready = false;
-        this->thread_state.flushing = false;
+        this->thread_state.flushing = 0;
+        while (this->port && this->handed.size() < this->stage_target() &&
+               !this->free_list.empty()) {
+            this->hand(this->free_list.front());
+            this->free_list.pop_front();
+        }
+    }
 
-        while (this->simulation.running) {
-            auto now = std::chrono::steady_clock::now();
+    /* One iteration of the main loop: handle all events due by now, with
+     * the engine simulation::pick_engine() set */
+    void step() { this->engine.load(std::memory_order_relaxed)(*this); }
+    template <class E> static void step_as(capuch &c) {
+        c.step_with(E{c.p.conf, c.clk});
+    }
+    template <class E> void step_with(const E &e) {
+        auto now = this->thread_state.now = e.now();
+
+        if (this->group)
+            this->group->poll(now);
+        for (auto &f : this->in_flight)
+            if (f.finish == sim_clock::time_point::max() && f.job->submitted())
+                f.finish = f.job->finish;
+        /* The disk was flushed: queued flushes are done, not those still in
+         * the flush pipeline */
+        auto flushed = this->disk.last_flush();
+        if (flushed != this->thread_state.disk_flushed) {
+            for (auto &f : this->in_flight)
+                if (f.finish != sim_clock::time_point::max() &&
+                    f.finish > flushed)
+                    f.finish = flushed;
+            this->thread_state.disk_flushed = flushed;
+        }
 
-            /* First check timeout case - we are not flushing and not ready
-             * and last flush finished more then X seconds ago*/
-            if (!this->thread_state.flushing &&
-                !this->thread_state.flush_ready &&
-                now > this->thread_state.flush_finish &&
-                (now - this->thread_state.flush_finish) >=
-                    std::chrono::nanoseconds(this->p.conf.flush_timeout_ns)) {
-                this->on_timeout();
+        /* First check timeout case - we are not flushing and not ready
+         * and last flush finished more then X seconds ago*/
+        if (this->in_flight.empty() && !this->thread_state.flush_ready &&
+            now > this->thread_state.flush_finish &&
+            (now - this->thread_state.flush_finish) >=
+                std::chrono::nanoseconds(this->p.conf.flush_timeout_ns)) {
+            this->on_timeout(e);
+        }
+
+        /* Calculate how many new buffers were created since last
+         * iteration. Invoke ready event for each. */
+        auto n_new_ready = std::chrono::duration_cast<std::chrono::seconds>(
+                               now - this->thread_state.last_ready)
+                               .count() *
+                           this->simulation.ready_per_sec;
+        if (n_new_ready) {
+            double gap = std::chrono::duration<double>(
+                             now - this->thread_state.last_ready)
+                             .count();
+            ewma_add(this->ewma.fill_gap, gap);
+            ewma_add(this->ewma.fill_per_sec, n_new_ready / gap);
+            if (e.greed_ctl())
+                this->control_greed(e, false, false);
+        }
+        /* Once stopped, the rest of a long catch-up is not waited for */
+        auto &running = this->simulation.running;
+        for (int i = 0;
+             i < n_new_ready && running.load(std::memory_order_relaxed); ++i) {
+            if (!this->port) {
+                this->on_ready(e);
+            } else if (!this->threaded_producer) {
+                this->on_produced(e);
+                this->produce(now);
             }
+            this->thread_state.last_ready = now;
+        }
+        /* A producer thread writes at its pace, take what it filled */
+        if (this->port && (n_new_ready || this->threaded_producer))
+            this->on_produced(e);
+
+        /* Every flush whose finish time has passed, in whatever order they
+         * were started - it is time to trigger flush finish event. */
+        for (size_t i = 0; i < this->in_flight.size();) {
+            if (now >= this->in_flight[i].finish)
+                this->on_flush_finish(i);
+            else
+                ++i;
+        }
+
+        /* If there is room for one more flush (after the finishes, both
+         * can happen in THIS order, important) and we have more ready - it
+         * is flush start event. */
+        if ((long)this->in_flight.size() < this->flush_depth() &&
+            this->thread_state.flush_ready) {
+            this->on_flush_start();
+        }
+
+        this->repay();
+        this->publish();
+        this->p.refill_reserve(this->shard);
+        this->p.maintain();
+        this->drain_spill();
+    }
+
+    /* Leave a running simulation: flush what is ready, wait until no
+     * pipeline or group commit points into this capuch any more, then give
+     * every buffer and the pressure back to the pool, the others' quota takes
+     * them on their next sync. Buffers of flushes still in flight go back as
+     * well, the disk has them queued already. The thread must be stopped. */
+    void detach() {
+        this->thread_state.now = this->clk.now();
+        if (this->port) {
+            this->port->flush(); /* Its producer is stopped */
+            this->take_produced(this->generic());
+        }
+        if (this->batch_size) {
+            this->thread_state.flush_ready = true;
+            this->on_flush_start(); /* The last one, even past flush_depth */
+        }
+        for (auto &f : this->in_flight) {
+            while (f.job && !f.job->submitted()) {
+                if (this->group)
+                    this->group->flush();
+                std::this_thread::yield();
+            }
+        }
+
+        auto lk = this->p.lock(this->shard);
+        this->p.stats.locks_taken++;
+        if (this->board)
+            this->board->close(this->box, [this](int id) {
+                this->p.give(this->shard, {.id = id});
+            });
+        this->box = -1;
+        this->box_want = 0;
+        for (auto &r : this->free_list)
+            this->p.give(this->shard, r);
+        for (auto &r : this->ready_list)
+            this->p.give(this->shard, r);
+        for (auto &r : this->handed)
+            this->p.give(this->shard, r);
+        if (this->active_rsc.has_value())
+            this->p.give(this->shard, *this->active_rsc);
+        this->free_list.clear();
+        this->ready_list.clear();
+        this->handed.clear();
+        this->active_rsc.reset();
+        this->p.settle_reserve(this->borrowed);
+        this->borrowed = 0;
+        this->in_flight.clear();
+        this->greed = 0;
+        this->account_pressure();
+    }
 
-            /* Calculate how many new buffers were created since last
-             * iteration. Invoke ready event for each. */
-            auto n_new_ready = std::chrono::duration_cast<std::chrono::seconds>(
-                                   now - this->thread_state.last_ready)
-                                   .count() *
-                               this->simulation.ready_per_sec;
-            for (int i = 0; i < n_new_ready; ++i) {
-                this->on_ready();
-                this->thread_state.last_ready = now;
-            }
+    /* Any capuch may drain any spilled batch, through the same path as its
+     * own flushes, once the disk backlog is below disk_conf.spill_drain_ms */
+    void drain_spill() {
+        if (!this->spill || !this->spill->get_pending())
+            return;
+        bool clear = this->disk.backlog() <=
+                     std::chrono::milliseconds(this->disk.conf.spill_drain_ms);
+        this->spill->drain(clear,
+                           [this](flush_job *job) { this->submit(job); });
+    }
 
-            /* If we are currently flushing and flush finish time has passed
-             * - it is time to trigger flush finish event. */
-            if (this->thread_state.flushing &&
-                now >= this->thread_state.flush_finish) {
-                this->on_flush_finish();
-            }
+    /* The pipeline's output goes through simulation::commit(), the same
+     * group commit or disk as here */
+    void submit(flush_job *job) {
+        if (this->pipe)
+            this->pipe->push(job);
+        else if (this->group)
+            this->group->push(job, this->clk.now());
+        else
+            job->finish.store(this->disk.add_bytes(job->bytes),
+                              std::memory_order_release);
+    }
 
-            /* If we re not flushing (NOT else-if, both can be correct in
-             * THIS order, important) and we have more ready - it is flush
-             * start event. */
-            if (!this->thread_state.flushing &&
-                this->thread_state.flush_ready) {
-                assert(now >= this->thread_state.flush_finish);
-                this->on_flush_start();
-            }
+    void main() {
+        this->placement.apply();
+        while (this->simulation.running) {
+            this->step();
+            this->placement.sample();
 
             /* @TODO: smart sleep, calculate next event time */
-            std::this_thread::sleep_for(std::chrono::nanoseconds(100000000));
+            this->clk.sleep_for(capuch::tick);
+        }
+    }
+    /* The tracer of a capuch with a port: ready_per_sec buffers worth of
+     * records a second, a tick's share at a time */
+    void produce_main() {
+        double owed = 0;
+        auto last = this->clk.now();
+        while (this->simulation.running) {
+            auto now = this->clk.now();
+            owed += std::chrono::duration<double>(now - last).count() *
+                    this->simulation.ready_per_sec;
+            last = now;
+            for (; owed >= 1; owed -= 1)
+                this->produce(now);
+            this->clk.sleep_for(capuch::tick);
         }
     }
+
+  public:
+    /* Wait for the threads of a stopped capuch */
+    void join() {
+        if (this->thread.joinable())
+            this->thread.join();
+        if (this->producer.joinable())
+            this->producer.join();
+    }
+};
+
+/* Specialized engines built in, tried in order */
+template <class... E> struct engine_list {
+    /* Step function of the first matching, nullptr if none does */
+    static capuch::stepper pick(const pool::pool_conf &conf,
+                                const sim_clock &clk) {
+        capuch::stepper s = nullptr;
+        ((s = s || !E::matches(conf, clk) ? s : &capuch::step_as<E>), ...);
+        return s;
+    }
 };
 
+/* Greed bounds and flush size with either greed controller and any clock */
+template <long MinGreed, long MaxGreed, long FlushSize>
+using engines_for = engine_list<
+    fixed_engine<MinGreed, MaxGreed, FlushSize, false, real_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, false, coarse_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, false, scaled_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, false, manual_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, true, real_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, true, coarse_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, true, scaled_clock>,
+    fixed_engine<MinGreed, MaxGreed, FlushSize, true, manual_clock>>;
+
+/* For the default conf, or make ENGINE_CONF=MIN_GREED,MAX_GREED,FLUSH_SIZE
+ * (from clean) to build them for the one of a sweep */
+#ifndef ENGINE_CONF
+#define ENGINE_CONF 1, 20, 8
+#endif
+typedef engines_for<ENGINE_CONF> fixed_engines;
+
 class simulation {
     friend class view;
 
   public:
+    enum clock_kind { clock_real, clock_coarse, clock_scaled, clock_manual };
+
     struct {
-        long ncapuch = 12;
+        std::atomic_long ncapuch = 12;
+        std::atomic_long metrics = 0;
+        std::atomic_long clock = clock_real;
+        std::atomic_long clock_scale = 10;
+        std::atomic_long shm = 0;
+        std::atomic_long coord_period_ms = 1000;
+        /* Rack wide, 0 is sum of nodes total_rsc */
+        std::atomic_long coord_budget = 0;
+        /* Priority of worker threads, 0 is normal */
+        std::atomic_long sched_fifo = 0;
+        /* Worker threads take memory node locally */
+        std::atomic_long numa = 0;
+        /* Trace written through a producer_port */
+        std::atomic_long producer = 0;
+        /* Specialized capuch engine if one matches */
+        std::atomic_long engine = 1;
     } conf;
     pool::pool_conf pool_conf;
     disk_sim::disk_conf disk_conf;
+    std::string metrics_path = "/tmp/capuchinos.sock";
+    std::string shm_name = "/capuchinos";
+    std::string flush_path; /* Flushed buffers are written here if set */
+    std::string spill_path; /* Per process default in /tmp if empty */
+    std::string disk_trace_path; /* Latencies for disk_conf.jitter_dist 4 */
+    /* Set with the affinity command. Capuch n is pinned to the n-th CPU of
+     * its list (round robin), flusher and UI threads to the whole list. */
+    cpu_list capuch_cpus, flusher_cpus, ui_cpus;
+    thread_placement ui_placement;
 
-    std::map<std::string, long &> conf_map = {
+    std::map<std::string, std::atomic_long &> conf_map = {
         {"conf.ncapuch", conf.ncapuch},
+        {"conf.metrics", conf.metrics},
+        {"conf.clock", conf.clock},
+        {"conf.clock_scale", conf.clock_scale},
+        {"conf.shm", conf.shm},
+        {"conf.coord_period_ms", conf.coord_period_ms},
+        {"conf.coord_budget", conf.coord_budget},
+        {"conf.sched_fifo", conf.sched_fifo},
+        {"conf.numa", conf.numa},
+        {"conf.producer", conf.producer},
+        {"conf.engine", conf.engine},
 
         {"pool_conf.flush_size", pool_conf.flush_size},
         {"pool_conf.flush_timeout_ns", pool_conf.flush_timeout_ns},
+        {"pool_conf.flush_depth", pool_conf.flush_depth},
         {"pool_conf.min_greed", pool_conf.min_greed},
         {"pool_conf.max_greed", pool_conf.max_greed},
+        {"pool_conf.greed_ctl", pool_conf.greed_ctl},
+        {"pool_conf.greed_headroom_pct", pool_conf.greed_headroom_pct},
         {"pool_conf.min_bufs", pool_conf.min_bufs},
         {"pool_conf.reserve", pool_conf.reserve},
         {"pool_conf.total_rsc", pool_conf.total_rsc},
+        {"pool_conf.max_rsc", pool_conf.max_rsc},
+        {"pool_conf.shards", pool_conf.shards},
+        {"pool_conf.donate", pool_conf.donate},
+        {"pool_conf.buf_size", pool_conf.buf_size},
 
         {"disk_conf.consume_per_second", disk_conf.consume_per_second},
+        {"disk_conf.compress", disk_conf.compress},
+        {"disk_conf.checksum", disk_conf.checksum},
+        {"disk_conf.spill_bufs", disk_conf.spill_bufs},
+        {"disk_conf.spill_drain_ms", disk_conf.spill_drain_ms},
+        {"disk_conf.op_cost_us", disk_conf.op_cost_us},
+        {"disk_conf.group_commit", disk_conf.group_commit},
+        {"disk_conf.group_window_ms", disk_conf.group_window_ms},
+        {"disk_conf.group_max_bufs", disk_conf.group_max_bufs},
+        {"disk_conf.jitter_dist", disk_conf.jitter_dist},
+        {"disk_conf.jitter_us", disk_conf.jitter_us},
+        {"disk_conf.jitter_shape_pct", disk_conf.jitter_shape_pct},
+        {"disk_conf.stall_every_ms", disk_conf.stall_every_ms},
+        {"disk_conf.stall_rate_per_min", disk_conf.stall_rate_per_min},
+        {"disk_conf.stall_ms", disk_conf.stall_ms},
+        {"disk_conf.qd_saturation", disk_conf.qd_saturation},
     };
 
   private:
     bool running = false;
-    std::vector<std::thread> capuches_threads;
-    std::vector<capuch> capuches;
+    /* Pointers, capuches come and go while their threads (and the pipeline,
+     * group commit) hold on to them. Changed on the UI thread only, the
+     * guard is for other threads reading it (metrics). */
+    std::vector<std::unique_ptr<capuch>> capuches;
+    /* Out of capuches, still giving their buffers and pressure back, see
+     * remove_capuches(). Under the same guard. */
+    std::vector<std::unique_ptr<capuch>> leaving;
+    std::mutex capuches_guard;
+    /* Odd while capuches come or go, their pressure is then accounted in
+     * the pool but not theirs in capuches or the other way round */
+    seqlock membership;
+    int next_capuch_id = 0;
     pool *p;
     disk_sim *disk;
+    std::unique_ptr<sim_clock> clk;
+    std::unique_ptr<flush_pipeline> pipe;
+    std::unique_ptr<spill_file> spill;
+    std::unique_ptr<group_commit> group;
+    std::unique_ptr<donation_board> board;
+    std::unique_ptr<metrics_server> metrics;
+    std::unique_ptr<coord_server> coord_srv;
+    std::unique_ptr<coord_node> coord_agent;
+    long coord_base_rsc, coord_base_reserve; /* pool_conf before joining */
+    std::string checkpoint_status; /* Of the last save or load */
+
+    /* Where processed flush jobs go, see capuch::submit() */
+    void commit(flush_job *job) {
+        if (this->group)
+            this->group->push(job, this->clk->now());
+        else
+            job->finish.store(this->disk->add_bytes(job->bytes),
+                              std::memory_order_release);
+    }
+
+    /* OpenMetrics exposition. Reads only atomics and seqlock snapshots, so a
+     * scrape never takes pool::run.guard nor stalls capuch threads. */
+    std::string render_metrics() {
+        std::stringstream ss;
+        auto family = [&ss](const char *name, const char *type,
+                             const char *help) {
+            ss << "# TYPE capuchinos_" << name << " " << type << "\n";
+            ss << "# HELP capuchinos_" << name << " " << help << "\n";
+        };
+
+        family("pool_total_rsc", "gauge", "Buffers owned by the pool");
+        ss << "capuchinos_pool_total_rsc " << this->p->size() << "\n";
+        family("pool_capacity", "gauge", "Buffers the pool can grow to");
+        ss << "capuchinos_pool_capacity " << this->p->capacity() << "\n";
+        family("pool_total_pressure", "gauge", "Sum of capuch pressures");
+        ss << "capuchinos_pool_total_pressure "
+           << this->p->published.total_pressure.load() << "\n";
+        family("pool_group_pressure", "gauge",
+               "Pressure of the capuches of a group and its subgroups");
+        for (int g = 0; g < this->p->ngroups(); ++g)
+            ss << "capuchinos_pool_group_pressure{group=\""
+               << this->p->group_path(g) << "\"} "
+               << this->p->share(g).pressure << "\n";
+        family("pool_group_budget", "gauge",
+               "Buffers for a group and its subgroups");
+        for (int g = 0; g < this->p->ngroups(); ++g)
+            ss << "capuchinos_pool_group_budget{group=\""
+               << this->p->group_path(g) << "\"} " << this->p->share(g).budget
+               << "\n";
+        family("pool_free", "gauge", "Buffers in the pool free list");
+        ss << "capuchinos_pool_free " << this->p->published.free.load()
+           << "\n";
+        family("pool_shard_free", "gauge", "Buffers in a shard free list");
+        for (int k = 0; k < this->p->nshards(); ++k)
+            ss << "capuchinos_pool_shard_free{shard=\"" << k << "\"} "
+               << this->p->shard(k).free.load() << "\n";
+        family("pool_shard_locks_taken", "counter",
+               "Shard lock acquisitions");
+        for (int k = 0; k < this->p->nshards(); ++k)
+            ss << "capuchinos_pool_shard_locks_taken_total{shard=\"" << k
+               << "\"} " << this->p->shard(k).locks_taken.load() << "\n";
+        family("pool_shard_stolen", "counter",
+               "Buffers taken from a shard by capuches of others");
+        for (int k = 0; k < this->p->nshards(); ++k)
+            ss << "capuchinos_pool_shard_stolen_total{shard=\"" << k
+               << "\"} " << this->p->shard(k).stolen.load() << "\n";
+        family("pool_locks_taken", "counter", "Pool lock acquisitions");
+        ss << "capuchinos_pool_locks_taken_total "
+           << this->p->stats.locks_taken.load() << "\n";
+        family("pool_bufs_lost", "counter", "Ready buffers overwritten");
+        ss << "capuchinos_pool_bufs_lost_total "
+           << this->p->stats.bufs_lost.load() << "\n";
+        family("pool_reserve", "gauge", "Buffers on the reserve stack");
+        ss << "capuchinos_pool_reserve " << this->p->reserve_count() << "\n";
+        family("pool_reserve_lent", "gauge",
+               "Reserve buffers held by capuches until their flush");
+        ss << "capuchinos_pool_reserve_lent " << this->p->reserve_lent()
+           << "\n";
+        family("pool_reserve_hits", "counter",
+               "Buffers taken from the reserve instead of overwriting");
+        ss << "capuchinos_pool_reserve_hits_total "
+           << this->p->stats.reserve_hits.load() << "\n";
+        family("pool_reserve_misses", "counter",
+               "Reserve found empty by a capuch out of buffers");
+        ss << "capuchinos_pool_reserve_misses_total "
+           << this->p->stats.reserve_misses.load() << "\n";
+        family("pool_reserve_refill_seconds", "histogram",
+               "From the first take to the reserve full again");
+        this->p->reserve_refill_latency().render(
+            ss, "capuchinos_pool_reserve_refill_seconds", "");
+        family("pool_bufs_recovered", "counter",
+               "Buffers recovered from crashed processes");
+        ss << "capuchinos_pool_bufs_recovered_total "
+           << this->p->stats.bufs_recovered.load() << "\n";
+        if (auto &board = this->board) {
+            family("donation_boxless", "gauge",
+                   "Capuches left without a donation box");
+            ss << "capuchinos_donation_boxless " << board->stats.boxless
+               << "\n";
+        }
+        if (this->pipe) {
+            family("flush_raw_bytes", "counter", "Bytes into flush pipeline");
+            ss << "capuchinos_flush_raw_bytes_total "
+               << this->pipe->stats.raw_bytes.load() << "\n";
+            family("flush_out_bytes", "counter", "Bytes charged to disk");
+            ss << "capuchinos_flush_out_bytes_total "
+               << this->pipe->stats.out_bytes.load() << "\n";
+            family("flush_compress_cpu_seconds", "counter",
+                   "Compression thread CPU time");
+            ss << "capuchinos_flush_compress_cpu_seconds_total "
+               << this->pipe->stats.compress_ns.load() / 1e9 << "\n";
+            family("flush_checksum_cpu_seconds", "counter",
+                   "Checksum thread CPU time");
+            ss << "capuchinos_flush_checksum_cpu_seconds_total "
+               << this->pipe->stats.checksum_ns.load() / 1e9 << "\n";
+            family("flush_write_errors", "counter",
+                   "Failed writes to the flush file");
+            ss << "capuchinos_flush_write_errors_total "
+               << this->pipe->stats.write_errors.load() << "\n";
+        }
+        family("disk_ops", "counter", "Disk operations");
+        ss << "capuchinos_disk_ops_total " << this->disk->stats.ops.load()
+           << "\n";
+        family("disk_stalls", "counter", "Disk jobs held off by a stall");
+        ss << "capuchinos_disk_stalls_total "
+           << this->disk->stats.stalls.load() << "\n";
+        family("disk_service_seconds", "histogram",
+               "Disk job start to finish, stalls not included");
+        this->disk->stats.service.render(ss, "capuchinos_disk_service_seconds",
+                                         "");
+        family("disk_cas_retries", "counter",
+               "Failed CAS on the disk expected finish");
+        ss << "capuchinos_disk_cas_retries_total "
+           << this->disk->stats.cas_retries.load() << "\n";
+        if (auto &group = this->group) {
+            family("group_commits", "counter", "Group commits to disk");
+            ss << "capuchinos_group_commits_total "
+               << group->stats.groups.load() << "\n";
+            family("group_jobs", "counter", "Flush jobs in group commits");
+            ss << "capuchinos_group_jobs_total " << group->stats.jobs.load()
+               << "\n";
+        }
+        family("disk_backlog_seconds", "gauge", "Disk write queue length");
+        ss << "capuchinos_disk_backlog_seconds "
+           << std::chrono::duration<double>(this->disk->backlog()).count()
+           << "\n";
+        if (auto &spill = this->spill) {
+            family("spill_pending", "gauge", "Buffers in the overflow file");
+            ss << "capuchinos_spill_pending " << spill->get_pending() << "\n";
+            family("spill_bufs", "counter", "Buffers spilled");
+            ss << "capuchinos_spill_bufs_total " << spill->stats.spilled.load()
+               << "\n";
+            family("spill_bytes", "counter", "Bytes spilled");
+            ss << "capuchinos_spill_bytes_total "
+               << spill->stats.spilled_bytes.load() << "\n";
+            family("spill_drained_bufs", "counter", "Buffers drained to disk");
+            ss << "capuchinos_spill_drained_bufs_total "
+               << spill->stats.drained.load() << "\n";
+            family("spill_full", "counter", "Spills refused, file full");
+            ss << "capuchinos_spill_full_total " << spill->stats.full.load()
+               << "\n";
+            family("spill_drain_latency_seconds", "histogram",
+                   "From spill to disk");
+            spill->drain_latency.render(
+                ss, "capuchinos_spill_drain_latency_seconds", "");
+        }
+
+        std::lock_guard<std::mutex> lk(this->capuches_guard);
+        std::vector<std::array<long, capuch::pub_nfields>> snaps;
+        for (auto &capuch : this->capuches)
+            snaps.push_back(capuch->read_snapshot());
+
+        struct {
+            capuch::published_field field;
+            const char *name, *type, *help;
+        } fields[] = {
+            {capuch::pub_batch_id, "capuch_batch_id", "gauge",
+             "Current batch id"},
+            {capuch::pub_greed, "capuch_greed", "gauge", "Greed level"},
+            {capuch::pub_priority, "capuch_priority", "gauge", "Priority"},
+            {capuch::pub_pressure, "capuch_pressure", "gauge",
+             "Pressure, (1 << greed) * priority"},
+            {capuch::pub_quota, "capuch_quota", "gauge", "Buffer quota"},
+            {capuch::pub_nbufs, "capuch_nbufs", "gauge", "Buffers held"},
+            {capuch::pub_free, "capuch_free", "gauge", "Free list size"},
+            {capuch::pub_ready, "capuch_ready", "gauge", "Ready list size"},
+            {capuch::pub_in_flight, "capuch_in_flight", "gauge",
+             "Flushes in flight"},
+            {capuch::pub_greed_inc, "capuch_greed_inc", "counter",
+             "Greed increments"},
+            {capuch::pub_greed_dec, "capuch_greed_dec", "counter",
+             "Greed decrements"},
+            {capuch::pub_timeout, "capuch_timeout", "counter",
+             "Flush timeouts"},
+        };
+        for (auto &f : fields) {
+            bool counter = !strcmp(f.type, "counter");
+            family(f.name, f.type, f.help);
+            for (size_t i = 0; i < snaps.size(); ++i)
+                ss << "capuchinos_" << f.name << (counter ? "_total" : "")
+                   << "{capuch=\"" << this->capuches[i]->id << "\"} "
+                   << snaps[i][f.field] << "\n";
+        }
+
+        family("capuch_flush_latency_seconds", "histogram",
+               "Flush start to observed flush finish");
+        for (auto &capuch : this->capuches)
+            capuch->flush_latency().render(
+                ss, "capuchinos_capuch_flush_latency_seconds",
+                "capuch=\"" + std::to_string(capuch->id) + "\"");
+
+        if (this->conf.producer) {
+            family("producer_records", "counter", "Records committed");
+            for (auto &capuch : this->capuches)
+                ss << "capuchinos_producer_records_total{capuch=\""
+                   << capuch->id << "\"} "
+                   << capuch->get_port()->stats.records.load() << "\n";
+            family("producer_dropped", "counter",
+                   "Records with no buffer staged to go to");
+            for (auto &capuch : this->capuches)
+                ss << "capuchinos_producer_dropped_total{capuch=\""
+                   << capuch->id << "\"} "
+                   << capuch->get_port()->stats.dropped.load() << "\n";
+        }
+
+        ss << "# EOF\n";
+        return ss.str();
+    }
 
   public:
     simulation(bool start = false) {
@@ -401,45 +2538,729 @@ class simulation {
         }
     };
     ~simulation() { this->terminate(); }
+    bool is_manual() { return dynamic_cast<manual_clock *>(this->clk.get()); }
+
+    /* Manual clock only: move time forward by d, one capuch::tick at a time,
+     * running a step of every capuch after each. Deterministic. */
+    bool advance(std::chrono::nanoseconds d) {
+        auto clk = dynamic_cast<manual_clock *>(this->clk.get());
+        if (!clk)
+            return false;
+        while (d.count() > 0) {
+            auto dt = std::min(d, std::chrono::nanoseconds(capuch::tick));
+            clk->advance(dt);
+            for (auto &capuch : this->capuches)
+                capuch->step();
+            d -= dt;
+        }
+        return true;
+    }
     bool is_running() { return this->running; }
-    const std::vector<capuch> &get_capuches() { return this->capuches; }
-    void start() {
-        assert(!this->running);
-        this->running = true;
-        this->p = new pool(this->pool_conf);
-        this->disk = new disk_sim(this->disk_conf);
-        this->capuches.reserve(this->conf.ncapuch);
-        this->capuches_threads.reserve(this->conf.ncapuch);
+    const std::vector<std::unique_ptr<capuch>> &get_capuches() {
+        return this->capuches;
+    }
 
-        /* Initialization is in three phases */
+    /* Attach n more capuches, in the same three phases as at start */
+    void add_capuches(int n) {
+        std::vector<capuch *> added;
 
         /* 1. Create and set initial greed */
-        for (int i = 0; i < this->conf.ncapuch; ++i) {
-            this->capuches.emplace_back(i, *this->p, *this->disk);
-            this->capuches[i].inc_greed();
+        for (int i = 0; i < n; ++i) {
+            auto c = std::make_unique<capuch>(
+                this->next_capuch_id++, *this->p, *this->disk, *this->clk,
+                this->pipe.get(), this->spill.get(), this->group.get(),
+                this->board.get());
+            c->shard = this->home_shard(c->id);
+            if (this->conf.producer)
+                c->port = std::make_unique<producer_port>(
+                    this->pool_conf.buf_size);
+            this->membership.write_begin();
+            c->inc_greed(c->generic());
+            added.push_back(c.get());
+            {
+                std::lock_guard<std::mutex> lk(this->capuches_guard);
+                this->capuches.push_back(std::move(c));
+            }
+            this->membership.write_end();
         }
 
-        /* 2. Get first buffers */
-        for (int i = 0; i < this->conf.ncapuch; ++i) {
-            this->capuches[i].sync_quota();
+        /* 2. Get first buffers. Joining a running simulation, the pool may
+         * be short until the others sync their lower quota. */
+        for (auto c : added) {
+            if (c->held() != c->quota())
+                c->sync_quota();
+            c->init();
         }
 
         /* 3. After the first 2 synchronously done, start async workers */
-        for (int i = 0; i < this->conf.ncapuch; ++i) {
-            this->capuches_threads.emplace_back(&capuch::main,
-                                                &this->capuches[i]);
+        for (auto c : added)
+            this->launch(c);
+    }
+
+    /* Start the worker thread of capuch c, stepping with the engine for the
+     * conf. Manual clock has no workers, advance() steps capuches in turn. */
+    void launch(capuch *c) {
+        c->simulation.running = true;
+        c->engine = this->pick_engine();
+        c->threaded_producer = c->port && !this->is_manual();
+        if (this->is_manual())
+            return;
+        auto &pl = c->placement;
+        pl.role = "capuch " + std::to_string(c->id);
+        if (!this->capuch_cpus.empty())
+            pl.cpus = {this->capuch_cpus[c->id % this->capuch_cpus.size()]};
+        pl.fifo = this->conf.sched_fifo;
+        pl.numa = this->conf.numa;
+        c->thread = std::thread(&capuch::main, c);
+        if (c->port)
+            c->producer = std::thread(&capuch::produce_main, c);
+    }
+
+    /* Shard of the node of the capuch's CPU when pinned with conf.numa, so
+     * that with a shard per node buffers stay on it, else round robin */
+    int home_shard(int id) {
+        int key = id;
+        if (this->conf.numa && !this->capuch_cpus.empty() && !this->is_manual())
+            key = numa_node_of_cpu(
+                this->capuch_cpus[id % this->capuch_cpus.size()]);
+        return key % this->p->nshards();
+    }
+
+    /* Detach capuches with ids start..end: stop them, flush what they have
+     * ready and give their buffers and pressure back to the pool */
+    void remove_capuches(int start, int end) {
+        std::vector<capuch *> removed;
+        this->membership.write_begin();
+        {
+            std::lock_guard<std::mutex> lk(this->capuches_guard);
+            auto i = this->capuches.begin();
+            while (i != this->capuches.end()) {
+                if ((*i)->id >= start && (*i)->id <= end) {
+                    removed.push_back(i->get());
+                    this->leaving.push_back(std::move(*i));
+                    i = this->capuches.erase(i);
+                } else
+                    ++i;
+            }
+        }
+        this->membership.write_end();
+        /* Their pressure comes off the pool and off leaving together */
+        for (auto c : removed)
+            c->simulation.running = false;
+        for (auto c : removed) {
+            c->join();
+            c->detach();
+        }
+        std::vector<std::unique_ptr<capuch>> gone;
+        {
+            std::lock_guard<std::mutex> lk(this->capuches_guard);
+            gone.swap(this->leaving);
+        }
+    }
+
+    /* Check the pressure this process accounted in each group of the pool
+     * against the sum of its capuches' own. Both sides change lock-free one
+     * after the other, so a difference only counts if it stays the same
+     * over a few samples with no capuch coming or going. Then checks what
+     * each capuch published. Any thread. False with why set if wrong. */
+    bool audit_capuches(std::string &why) {
+        std::stringstream ss;
+        std::vector<long> diff, last;
+        for (int sample = 0; sample < 3; ++sample) {
+            if (sample)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            unsigned seq = this->membership.read_begin();
+            diff.assign(this->p->ngroups(), 0);
+            for (size_t g = 0; g < diff.size(); ++g)
+                diff[g] = this->p->own_pressure(g);
+            {
+                std::lock_guard<std::mutex> lk(this->capuches_guard);
+                for (auto *list : {&this->capuches, &this->leaving}) {
+                    for (auto &c : *list) {
+                        unsigned long accounted = c->accounted.load();
+                        if ((accounted >> 56) >= diff.size())
+                            diff.clear(); /* In a group just added */
+                        else
+                            diff[accounted >> 56] -=
+                                accounted & ((1UL << 56) - 1);
+                    }
+                }
+            }
+            if (this->membership.read_retry(seq) || diff.empty() ||
+                (sample && diff != last)) {
+                why.clear();
+                return true; /* Moving, try another time */
+            }
+            last = diff;
+        }
+        for (size_t g = 0; g < diff.size() && ss.str().empty(); ++g)
+            if (diff[g])
+                ss << "group " << g << " pool pressure "
+                   << this->p->own_pressure(g) << " off by " << diff[g]
+                   << " from its capuches'";
+        if (ss.str().empty()) {
+            std::lock_guard<std::mutex> lk(this->capuches_guard);
+            for (auto &c : this->capuches) {
+                auto v = c->read_snapshot();
+                if (v[capuch::pub_quota] < 0 || v[capuch::pub_nbufs] < 0 ||
+                    v[capuch::pub_free] < 0 || v[capuch::pub_ready] < 0 ||
+                    v[capuch::pub_free] + v[capuch::pub_ready] >
+                        v[capuch::pub_nbufs] ||
+                    v[capuch::pub_greed] < 0 || v[capuch::pub_greed] > 30) {
+                    ss << "capuch " << c->id << " published quota="
+                       << v[capuch::pub_quota]
+                       << " nbufs=" << v[capuch::pub_nbufs]
+                       << " free=" << v[capuch::pub_free]
+                       << " ready=" << v[capuch::pub_ready]
+                       << " greed=" << v[capuch::pub_greed];
+                    break;
+                }
+            }
+        }
+        why = ss.str();
+        return why.empty();
+    }
+    /* Pause the capuches, write what they and the pool hold to path (see
+     * checkpoint.hpp), resume them. False if it could not, see
+     * get_checkpoint_status(). */
+    bool save(const std::string &path) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (!this->running)
+            return this->checkpointed("nothing to save", false);
+        std::string why = this->unsaved();
+        if (!why.empty())
+            return this->checkpointed("cannot save with " + why, false);
+        this->pause();
+
+        checkpoint ck;
+        auto now = this->clk->now();
+        auto offset = [now](sim_clock::time_point t) {
+            return (int64_t)std::chrono::duration_cast<
+                       std::chrono::nanoseconds>(t - now)
+                .count();
+        };
+        for (auto &[name, value] : this->conf_map) {
+            checkpoint_conf e = {};
+            strncpy(e.name, name.c_str(), sizeof(e.name) - 1);
+            e.value = value;
+            ck.conf.push_back(e);
+        }
+        for (int g = 1; g < this->p->ngroups(); ++g) {
+            checkpoint_group e = {};
+            strncpy(e.path, this->p->group_path(g).c_str(),
+                    sizeof(e.path) - 1);
+            e.weight = this->p->group_weight(g);
+            ck.groups.push_back(e);
+        }
+        for (auto &c : this->capuches) {
+            std::vector<int> donated; /* Put back as they were */
+            if (c->box >= 0) {
+                auto &box = this->board->get(c->box);
+                for (int id; box.pop(id);)
+                    donated.push_back(id);
+                for (int id : donated)
+                    box.push(id);
+            }
+            checkpoint_capuch e = {};
+            e.id = c->id;
+            e.shard = c->shard;
+            e.tenant = c->tenant;
+            e.priority = c->priority;
+            e.ready_per_sec = c->simulation.ready_per_sec;
+            e.greed = c->greed;
+            e.batch_size = c->batch_size;
+            e.batch_id = c->batch_id;
+            e.borrowed = c->borrowed;
+            e.active = c->active_rsc ? c->active_rsc->id : -1;
+            e.active_batch_id = c->active_rsc ? c->active_rsc->batch_id : 0;
+            e.nfree = c->free_list.size();
+            e.nready = c->ready_list.size();
+            e.ndonated = donated.size();
+            e.nflushes = c->in_flight.size();
+            e.flush_ready = c->thread_state.flush_ready;
+            e.greed_inc = c->stats.greed_inc;
+            e.greed_dec = c->stats.greed_dec;
+            e.timeout = c->stats.timeout;
+            e.trace_rng = c->trace_rng;
+            e.trace_seq = c->trace_seq;
+            e.fill_per_sec = c->ewma.fill_per_sec;
+            e.fill_gap = c->ewma.fill_gap;
+            e.flush_sec = c->ewma.flush_sec;
+            e.set_for = c->ewma.set_for;
+            e.last_ready_ns = offset(c->thread_state.last_ready);
+            e.flush_finish_ns = offset(c->thread_state.flush_finish);
+            ck.capuches.push_back(e);
+            for (auto &r : c->free_list)
+                ck.buffers.push_back({r.id, r.batch_id});
+            for (auto &r : c->ready_list)
+                ck.buffers.push_back({r.id, r.batch_id});
+            for (int id : donated)
+                ck.buffers.push_back({id, 0});
+            for (auto &f : c->in_flight)
+                ck.flushes.push_back(
+                    {f.batch_id, offset(f.start), offset(f.finish)});
+        }
+        for (int id : this->p->reserve_ids())
+            ck.reserve.push_back(id);
+        ck.head.total_rsc = this->p->size();
+        ck.head.max_rsc = this->p->capacity();
+        ck.head.disk_backlog_ns = this->disk->backlog().count();
+        ck.head.disk_seq = this->disk->seq;
+        auto &st = ck.head.stats;
+        st.disk_ops = this->disk->stats.ops;
+        st.disk_stalls = this->disk->stats.stalls;
+        st.locks_taken = this->p->stats.locks_taken;
+        st.bufs_lost = this->p->stats.bufs_lost;
+        st.reserve_hits = this->p->stats.reserve_hits;
+        st.reserve_misses = this->p->stats.reserve_misses;
+        st.donations = this->board->stats.donations;
+        st.donated = this->board->stats.donated;
+
+        bool ok = ck.write(path, why);
+        this->resume();
+        if (!ok)
+            return this->checkpointed(why, false);
+        std::stringstream ss;
+        ss << "saved " << path << ", " << ck.capuches.size()
+           << " capuches in "
+           << std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - t0)
+                  .count()
+           << "ms";
+        return this->checkpointed(ss.str(), true);
+    }
+
+    /* Replace the simulation with the one saved at path, read in place
+     * from its mapping, and resume it. Times carry on from the clock now. */
+    bool load(const std::string &path) {
+        auto t0 = std::chrono::steady_clock::now();
+        checkpoint_map ck(path);
+        if (!ck.is_open())
+            return this->checkpointed(ck.get_error(), false);
+        auto &h = *ck.head;
+        std::string why = this->rejected(ck);
+        if (!why.empty())
+            return this->checkpointed(path + ": " + why, false);
+
+        this->terminate();
+        for (uint32_t i = 0; i < h.nconf; ++i) {
+            auto &e = ck.conf[i];
+            std::string name(e.name, strnlen(e.name, sizeof(e.name)));
+            auto field = this->conf_map.find(name);
+            /* Whether to share the pool is this process's choice */
+            if (field != this->conf_map.end() && name != "conf.shm")
+                field->second = e.value;
+        }
+        this->pool_conf.max_rsc = h.max_rsc; /* 0 would follow total_rsc */
+        this->boot();
+        assert(this->unsaved().empty());
+        this->restore(ck);
+        this->serve_metrics();
+        std::stringstream ss;
+        ss << "loaded " << path << ", " << h.ncapuch << " capuches in "
+           << std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - t0)
+                  .count()
+           << "ms";
+        return this->checkpointed(ss.str(), true);
+    }
+    const std::string &get_checkpoint_status() const {
+        return this->checkpoint_status;
+    }
+
+  private:
+    /* Why the running simulation cannot be checkpointed, empty if it can:
+     * what other threads, files or processes hold is not saved */
+    std::string unsaved() const {
+        if (this->p->is_shared())
+            return "a shared pool";
+        if (this->pipe)
+            return "a flush pipeline";
+        if (this->group)
+            return "group commit";
+        if (this->spill)
+            return "a spill file";
+        for (auto &capuch : this->capuches)
+            if (capuch->port)
+                return "producer ports";
+        return "";
+    }
+    /* Stop the capuch threads, they keep their state. See resume(). */
+    void pause() {
+        for (auto &capuch : this->capuches)
+            capuch->simulation.running = false;
+        for (auto &capuch : this->capuches)
+            capuch->join();
+    }
+    void resume() {
+        for (auto &capuch : this->capuches)
+            this->launch(capuch.get());
+    }
+    bool checkpointed(const std::string &status, bool ok) {
+        this->checkpoint_status = status;
+        return ok;
+    }
+
+    /* Why ck cannot be loaded, empty if it can. Checked in full before
+     * load() tears anything down: groups that fit in a pool, buffer ids
+     * below its capacity and each held once, counts that add up to the
+     * sections, borrowed buffers among those held, greed within the
+     * max_greed it brings. */
+    std::string rejected(const checkpoint_map &ck) const {
+        auto &h = *ck.head;
+        auto conf = [&](const char *name, long value) { /* As it would be */
+            for (uint32_t i = 0; i < h.nconf; ++i)
+                if (!strncmp(ck.conf[i].name, name, sizeof(ck.conf[i].name)))
+                    value = ck.conf[i].value;
+            return value;
+        };
+        /* What unsaved() would find once booted */
+        if (this->conf.shm)
+            return "cannot load with a shared pool";
+        if (!this->flush_path.empty() || conf("disk_conf.compress", 0) ||
+            conf("disk_conf.checksum", 0))
+            return "cannot load with a flush pipeline";
+        if (conf("disk_conf.group_commit", 0))
+            return "cannot load with group commit";
+        if (conf("disk_conf.spill_bufs", 0) > 0)
+            return "cannot load with a spill file";
+        if (conf("conf.producer", 0))
+            return "cannot load with producer ports";
+
+        long max_greed = conf("pool_conf.max_greed", this->pool_conf.max_greed);
+        if (h.max_rsc < 1 || h.total_rsc < 1 || h.total_rsc > h.max_rsc)
+            return "pool of " + std::to_string(h.total_rsc) + "/" +
+                   std::to_string(h.max_rsc) + " buffers";
+        if (max_greed < 0 || max_greed > 30) /* Pressure is 1 << greed */
+            return "max_greed " + std::to_string(max_greed);
+        if (h.max_rsc > INT32_MAX)
+            return "capacity " + std::to_string(h.max_rsc);
+        std::set<std::string> groups; /* Made by pool::group(), root aside */
+        for (uint32_t i = 0; i < h.ngroups; ++i) {
+            auto &e = ck.groups[i];
+            std::stringstream ss(
+                std::string(e.path, strnlen(e.path, sizeof(e.path))));
+            std::string path;
+            for (std::string name; std::getline(ss, name, '/');) {
+                if (name.empty())
+                    continue;
+                if (name.size() >= sizeof(pool::shared::group_t::name))
+                    return "group name " + name;
+                groups.insert(path += "/" + name);
+            }
+        }
+        if (groups.size() >= pool::shared::max_groups)
+            return std::to_string(groups.size()) + " groups";
+
+        std::vector<char> seen(h.max_rsc);
+        auto claim = [&](long id) {
+            return id >= 0 && id < h.max_rsc && !seen[id]++;
+        };
+        for (uint32_t i = 0; i < h.nreserve; ++i)
+            if (!claim(ck.reserve[i]))
+                return "reserve id " + std::to_string(ck.reserve[i]);
+        uint64_t nbuffers = 0, nflushes = 0;
+        for (uint32_t i = 0; i < h.ncapuch; ++i) {
+            auto &e = ck.capuches[i];
+            std::string capuch = "capuch " + std::to_string(e.id) + " ";
+            if (e.nfree < 0 || e.nready < 0 || e.ndonated < 0 ||
+                e.ndonated > (int)mailbox::capacity || e.nflushes < 0)
+                return capuch + "counts";
+            if (e.tenant < 0 || e.tenant > (int)groups.size())
+                return capuch + "tenant " + std::to_string(e.tenant);
+            if (e.greed < 0 || e.greed > max_greed)
+                return capuch + "greed " + std::to_string(e.greed);
+            if (e.active >= 0 && !claim(e.active))
+                return capuch + "active id " + std::to_string(e.active);
+            long held = e.nfree + e.nready + e.ndonated;
+            for (long n = held; n--; ++nbuffers)
+                if (nbuffers >= h.nbuffers || !claim(ck.buffers[nbuffers].id))
+                    return capuch + "buffers";
+            if (e.borrowed < 0 || e.borrowed > held + (e.active >= 0))
+                return capuch + "borrowed " + std::to_string(e.borrowed);
+            nflushes += e.nflushes;
+        }
+        if (nbuffers != h.nbuffers || nflushes != h.nflushes)
+            return "sections not adding up";
+        return "";
+    }
+
+    /* The booted, empty simulation as in ck, which passed rejected() */
+    void restore(const checkpoint_map &ck) {
+        auto &h = *ck.head;
+        std::vector<int> reserved(ck.reserve, ck.reserve + h.nreserve);
+        std::vector<int> taken;
+        long lent = 0;
+        for (uint32_t i = 0; i < h.ngroups; ++i) {
+            auto &e = ck.groups[i];
+            int g = this->p->group(
+                std::string(e.path, strnlen(e.path, sizeof(e.path))));
+            this->p->set_group_weight(g, e.weight);
+        }
+        for (uint32_t i = 0; i < h.ncapuch; ++i) {
+            auto &e = ck.capuches[i];
+            if (e.active >= 0)
+                taken.push_back(e.active);
+            lent += e.borrowed;
+        }
+        for (uint32_t i = 0; i < h.nbuffers; ++i)
+            taken.push_back(ck.buffers[i].id);
+
+        auto now = this->clk->now();
+        auto at = [now](int64_t ns) {
+            return now + std::chrono::nanoseconds(ns);
+        };
+        auto buffer = ck.buffers;
+        auto flush = ck.flushes;
+        std::vector<std::unique_ptr<capuch>> restored;
+        for (uint32_t i = 0; i < h.ncapuch; ++i) {
+            auto &e = ck.capuches[i];
+            auto c = std::make_unique<capuch>(
+                e.id, *this->p, *this->disk, *this->clk, this->pipe.get(),
+                this->spill.get(), this->group.get(), this->board.get());
+            c->shard = e.shard >= 0 && e.shard < this->p->nshards()
+                           ? e.shard
+                           : this->home_shard(e.id);
+            c->tenant = e.tenant;
+            c->priority = std::max(1, (int)e.priority);
+            c->simulation.ready_per_sec = e.ready_per_sec;
+            c->greed = e.greed;
+            c->batch_size = e.batch_size;
+            c->batch_id = e.batch_id;
+            c->borrowed = e.borrowed;
+            if (e.active >= 0)
+                c->active_rsc = resource{e.active, e.active_batch_id};
+            for (int n = 0; n < e.nfree; ++n, ++buffer)
+                c->free_list.push_back({buffer->id, buffer->batch_id});
+            for (int n = 0; n < e.nready; ++n, ++buffer)
+                c->ready_list.push_back(
+                    {buffer->id, buffer->batch_id, c->p.conf.buf_size});
+            for (int n = 0; n < e.ndonated; ++n, ++buffer)
+                if (c->box >= 0 && this->board->get(c->box).push(buffer->id))
+                    this->board->get(c->box).want--; /* As a donor would */
+                else
+                    c->free_list.push_back({buffer->id, 0});
+            for (int n = 0; n < e.nflushes; ++n, ++flush)
+                c->in_flight.push_back({(int)flush->batch_id,
+                                        at(flush->start_ns),
+                                        at(flush->finish_ns), nullptr});
+            c->thread_state.now = now;
+            c->thread_state.last_ready = at(e.last_ready_ns);
+            c->thread_state.flush_finish = at(e.flush_finish_ns);
+            c->thread_state.flush_ready = e.flush_ready;
+            c->thread_state.flushing = c->in_flight.size();
+            c->stats.greed_inc = e.greed_inc;
+            c->stats.greed_dec = e.greed_dec;
+            c->stats.timeout = e.timeout;
+            c->trace_rng = e.trace_rng;
+            c->trace_seq = e.trace_seq;
+            c->ewma.fill_per_sec = e.fill_per_sec;
+            c->ewma.fill_gap = e.fill_gap;
+            c->ewma.flush_sec = e.flush_sec;
+            c->ewma.set_for = e.set_for;
+            this->next_capuch_id = std::max(this->next_capuch_id, e.id + 1);
+            restored.push_back(std::move(c));
+        }
+
+        this->p->restore(h.total_rsc, reserved, taken, lent);
+        this->pool_conf.total_rsc = this->p->size();
+        this->disk->expected_finish = at(h.disk_backlog_ns);
+        this->disk->seq = h.disk_seq;
+        auto &st = h.stats;
+        this->disk->stats.ops += st.disk_ops;
+        this->disk->stats.stalls += st.disk_stalls;
+        this->p->stats.locks_taken += st.locks_taken;
+        this->p->stats.bufs_lost += st.bufs_lost;
+        this->p->stats.reserve_hits += st.reserve_hits;
+        this->p->stats.reserve_misses += st.reserve_misses;
+        this->board->stats.donations += st.donations;
+        this->board->stats.donated += st.donated;
+        this->membership.write_begin();
+        for (auto &c : restored) { /* As account_pressure(), in one epoch */
+            unsigned long pressure = c->greed ? c->pressure() : 0;
+            c->accounted = (unsigned long)c->tenant << 56 | pressure;
+            this->p->add_pressure(c->tenant, pressure);
+        }
+        this->p->publish();
+        for (auto &c : restored)
+            c->publish();
+        {
+            std::lock_guard<std::mutex> lk(this->capuches_guard);
+            for (auto &c : restored)
+                this->capuches.push_back(std::move(c));
+        }
+        this->membership.write_end();
+        this->resume();
+    }
+
+  public:
+    const metrics_server *get_metrics() { return this->metrics.get(); }
+    const coord_server *get_coord_server() { return this->coord_srv.get(); }
+    const coord_node *get_coord_node() { return this->coord_agent.get(); }
+
+    /* Coordinate this node's budget with the rack, see coord.hpp. The
+     * assignments overwrite pool_conf.total_rsc/reserve like a conf command
+     * would, and are undone by coord_leave(). */
+    bool coord_serve(const std::string &addr) {
+        this->coord_srv.reset();
+        this->coord_srv = std::make_unique<coord_server>(
+            addr, this->conf.coord_budget, this->conf.coord_period_ms);
+        return this->coord_srv->is_listening();
+    }
+    void coord_join(const std::string &addr) {
+        this->coord_leave();
+        this->coord_base_rsc = this->pool_conf.total_rsc;
+        this->coord_base_reserve = this->pool_conf.reserve;
+        this->coord_agent = std::make_unique<coord_node>(
+            addr, this->conf.coord_period_ms,
+            [this](coord_report &r) {
+                r.total_pressure = this->p->published.total_pressure;
+                r.backlog_ns =
+                    std::max(0L, (long)std::chrono::duration_cast<
+                                     std::chrono::nanoseconds>(
+                                     this->disk->expected_finish.load() -
+                                     this->clk->now())
+                                     .count());
+                r.capacity = this->p->capacity();
+                r.base_rsc = this->coord_base_rsc;
+                r.base_reserve = this->coord_base_reserve;
+            },
+            [this](long total_rsc, long reserve) {
+                this->pool_conf.total_rsc = this->p->resize(total_rsc);
+                this->pool_conf.reserve = reserve;
+                this->p->touch();
+            });
+    }
+    void coord_leave() {
+        if (this->coord_agent) {
+            this->coord_agent.reset();
+            this->pool_conf.total_rsc = this->p->resize(this->coord_base_rsc);
+            this->pool_conf.reserve = this->coord_base_reserve;
+            this->p->touch();
+        }
+    }
+
+    /* A conf command, unknown fields are ignored. The capuches read fields
+     * live without a lock: a change shows up a step late at worst. */
+    void set_conf(const std::string &field, long value) {
+        auto f = this->conf_map.find(field);
+        if (f != this->conf_map.end()) {
+            f->second = value;
+            this->conf_changed(field);
+        }
+    }
+    /* A conf command changed field. Most fields are read live or on the next
+     * start, the pool size has to be applied and cached quotas dropped. */
+    void conf_changed(const std::string &field) {
+        if (!this->running)
+            return;
+        if (field == "conf.engine" || !field.rfind("pool_conf.", 0)) {
+            auto engine = this->pick_engine();
+            for (auto &capuch : this->capuches)
+                capuch->engine = engine;
+        }
+        if (field.rfind("pool_conf.", 0))
+            return;
+        if (field == "pool_conf.total_rsc")
+            this->pool_conf.total_rsc =
+                this->p->resize(this->pool_conf.total_rsc);
+        this->p->touch();
+    }
+
+    /* A specialized engine built for the conf and clock as they are, the
+     * generic one if none is (or with conf.engine 0) */
+    capuch::stepper pick_engine() const {
+        capuch::stepper s = nullptr;
+        if (this->conf.engine)
+            s = fixed_engines::pick(this->pool_conf, *this->clk);
+        return s ? s : &capuch::step_as<generic_engine>;
+    }
+    bool is_engine_fixed() const {
+        return this->running &&
+               this->pick_engine() != &capuch::step_as<generic_engine>;
+    }
+
+    sim_clock &get_clock() { return *this->clk; }
+    void start() {
+        this->boot();
+        this->add_capuches(this->conf.ncapuch);
+        this->serve_metrics();
+    }
+    /* Clock, pool, disk and the rest as configured, no capuches yet */
+    void boot() {
+        assert(!this->running);
+        this->running = true;
+        switch (this->conf.clock) {
+        case clock_coarse:
+            this->clk = std::make_unique<coarse_clock>();
+            break;
+        case clock_scaled:
+            this->clk = std::make_unique<scaled_clock>(this->conf.clock_scale);
+            break;
+        case clock_manual:
+            this->clk = std::make_unique<manual_clock>();
+            break;
+        default:
+            this->clk = std::make_unique<real_clock>();
+        }
+        this->p = pool::open(this->pool_conf,
+                             this->conf.shm ? this->shm_name : "");
+        this->disk = new disk_sim(this->disk_conf, *this->clk,
+                                  this->pool_conf.buf_size);
+        if (!this->disk_trace_path.empty())
+            this->disk->model.load_trace(this->disk_trace_path);
+        if (this->disk_conf.group_commit)
+            this->group = std::make_unique<group_commit>(
+                [this](long bytes, long) {
+                    return this->disk->add_bytes(bytes);
+                },
+                std::chrono::milliseconds(this->disk_conf.group_window_ms),
+                this->disk_conf.group_max_bufs * this->pool_conf.buf_size);
+        if (this->disk_conf.compress || this->disk_conf.checksum ||
+            !this->flush_path.empty()) {
+            flush_pipeline::options opts;
+            opts.compress = this->disk_conf.compress;
+            opts.checksum = (checksum_algo)this->disk_conf.checksum.load();
+            opts.path = this->flush_path;
+            opts.buf_size = this->pool_conf.buf_size;
+            opts.threaded = !this->is_manual();
+            opts.cpus = this->flusher_cpus;
+            opts.fifo = this->conf.sched_fifo;
+            opts.numa = this->conf.numa;
+            this->pipe = std::make_unique<flush_pipeline>(
+                [this](flush_job *job) { this->commit(job); }, opts);
         }
+        if (this->disk_conf.spill_bufs > 0)
+            this->spill = std::make_unique<spill_file>(
+                this->spill_path.empty()
+                    ? "/tmp/capuchinos-" + std::to_string(getpid()) + ".spill"
+                    : this->spill_path,
+                this->pool_conf.buf_size, this->disk_conf.spill_bufs);
+        this->board = std::make_unique<donation_board>();
+        this->next_capuch_id = 0;
+    }
+    void serve_metrics() {
+        if (this->conf.metrics)
+            this->metrics = std::make_unique<metrics_server>(
+                this->metrics_path, [this] { return this->render_metrics(); });
     }
     void terminate() {
         if (this->running) {
+            this->metrics.reset(); /* Before anything it reads goes away */
+            this->coord_leave();
+            this->coord_srv.reset();
+            for (auto &capuch : this->capuches)
+                capuch->simulation.running = false;
             for (auto &capuch : this->capuches)
-                capuch.simulation.running = false;
-            for (auto &t : this->capuches_threads)
-                t.join();
+                capuch->join();
+            this->pipe.reset(); /* May still point into capuches' jobs */
+            this->spill.reset(); /* Its drain job too, so after the pipe */
+            this->group.reset();
             this->capuches.clear();
-            this->capuches_threads.clear();
+            this->board.reset();
             delete this->p;
             delete this->disk;
+            this->clk.reset();
             this->running = false;
         }
     }
@@ -449,6 +3270,21 @@ class view {
   private:
     simulation &sim;
     bool running = true;
+    bool headless; /* Output goes to stdout, see headless_main() */
+
+    /* Scenario being run, see scenario_step() */
+    struct {
+        std::unique_ptr<scenario> file;
+        bool quit_when_done = false;
+        /* Its time, kept across restarts of the simulation (new clocks) */
+        const sim_clock *clk = nullptr;
+        sim_clock::time_point origin;
+        long elapsed_ns = 0;
+        int failed = 0; /* Expectations, and commands refused */
+        std::deque<std::string> log; /* Latest last, for the UI */
+        std::map<std::string, double> reported; /* At the last report */
+        long reported_ns = 0;
+    } scen;
 
   private:
     bool command_dispatcher(const std::string &_cmd) {
@@ -464,40 +3300,106 @@ class view {
         } else if (cmd == "term") {
             this->sim.terminate();
         } else if (this->sim.is_running() && cmd.rfind("capuch", 0) == 0) {
+            std::string subcmd;
             int start, end;
-            ss >> start >> end;
-            if (start < 0)
-                start = 0;
-            if (end >= this->sim.conf.ncapuch)
-                end = this->sim.conf.ncapuch - 1;
-            if (start <= end) {
-                std::string subcmd;
-                int value;
-                ss >> subcmd >> value;
-                if (subcmd == "speed") {
-                    for (int i = start; i <= end; ++i)
-                        this->sim.capuches[i].simulation.ready_per_sec = value;
-                } else if (subcmd == "priority") {
-                    for (int i = start; i <= end; ++i) {
-                        this->sim.capuches[i].set_priority(value);
-                    }
+            if (ss >> std::ws && isalpha(ss.peek()))
+                ss >> subcmd;
+            if (subcmd == "add") {
+                int n = 0;
+                ss >> n;
+                if (n <= 0)
+                    return false;
+                this->sim.add_capuches(n);
+            } else if (subcmd == "remove") {
+                if (!(ss >> start >> end) || start > end)
+                    return false;
+                this->sim.remove_capuches(start, end);
+            } else if (subcmd.empty() && ss >> start >> end && start <= end) {
+                int value = 0, tenant = -1;
+                ss >> subcmd;
+                if (subcmd == "group") {
+                    std::string path;
+                    ss >> path;
+                    if ((tenant = this->sim.p->group(path)) < 0)
+                        return false;
+                } else
+                    ss >> value;
+                /* By id, removed ones leave holes */
+                for (auto &capuch : this->sim.capuches) {
+                    if (capuch->id < start || capuch->id > end)
+                        continue;
+                    if (subcmd == "speed")
+                        capuch->simulation.ready_per_sec = value;
+                    else if (subcmd == "priority")
+                        capuch->set_priority(value);
+                    else if (subcmd == "group")
+                        capuch->set_tenant(tenant);
                 }
             }
         } else if (this->sim.is_running() && cmd.rfind("disk-flush", 0) == 0) {
             std::string subcmd;
-            this->sim.disk->expected_finish.store(
-                std::chrono::steady_clock::now());
-            for (auto &capuch : this->sim.capuches) {
-                capuch.thread_state.flush_finish =
-                    std::chrono::steady_clock::now();
-            }
+            this->sim.disk->flush();
+        } else if (this->sim.is_running() && cmd == "clock") {
+            std::string subcmd;
+            long ns = 0;
+            ss >> subcmd >> ns;
+            if (subcmd != "advance" ||
+                !this->sim.advance(std::chrono::nanoseconds(ns)))
+                return false;
+        } else if (this->sim.is_running() && cmd == "coord") {
+            std::string subcmd, addr;
+            ss >> subcmd >> addr;
+            if (subcmd == "serve" && !addr.empty())
+                this->sim.coord_serve(addr);
+            else if (subcmd == "join" && !addr.empty())
+                this->sim.coord_join(addr);
+            else if (subcmd == "stop") {
+                this->sim.coord_leave();
+                this->sim.coord_srv.reset();
+            } else
+                return false;
+        } else if (this->sim.is_running() && cmd == "group") {
+            std::string path;
+            long weight = 0;
+            if (!(ss >> path >> weight))
+                return false;
+            int g = this->sim.p->group(path);
+            if (g < 0)
+                return false;
+            this->sim.p->set_group_weight(g, weight);
+        } else if (cmd == "scenario") {
+            std::string path;
+            ss >> path;
+            return this->run_scenario(path, false);
+        } else if (cmd == "save" || cmd == "load") {
+            std::string path;
+            if (!(ss >> path))
+                return false;
+            if (cmd == "save")
+                this->sim.save(path);
+            else
+                this->sim.load(path);
+        } else if (cmd == "affinity") {
+            std::string role, list;
+            cpu_list cpus;
+            ss >> role >> list;
+            if (!cpu_list_parse(list, cpus))
+                return false;
+            if (role == "capuch")
+                this->sim.capuch_cpus = cpus;
+            else if (role == "flusher")
+                this->sim.flusher_cpus = cpus;
+            else if (role == "ui") {
+                /* This very thread, right away */
+                this->sim.ui_cpus = this->sim.ui_placement.cpus = cpus;
+                this->sim.ui_placement.apply();
+            } else
+                return false;
         } else if (cmd.rfind("conf", 0) == 0) {
             std::string target;
             long value;
             ss >> target >> value;
-            auto field = this->sim.conf_map.find(target);
-            if (field != this->sim.conf_map.end())
-                field->second = value;
+            this->sim.set_conf(target, value);
         }
         /* Unhandled command */
         else {
@@ -507,7 +3409,7 @@ class view {
         return true;
     }
 
-    void update_global_stats(nc_win_txt &txt) {
+    std::string global_stats() {
         std::stringstream ss;
         if (!sim.is_running()) {
             ss << "Simulation not running" << std::endl;
@@ -515,27 +3417,148 @@ class view {
             ss << "Simulation is running" << std::endl;
             ss << "Disk write queue(millis)="
                << std::chrono::duration_cast<std::chrono::milliseconds>(
-                      sim.disk->expected_finish.load() -
-                      std::chrono::steady_clock::now())
+                      sim.disk->expected_finish.load() - sim.clk->now())
                       .count()
                << std::endl;
-            ss << "Total pressure=" << sim.p->run.total_pressure << std::endl;
-            ss << "Total free=" << sim.p->run.free.size() << std::endl;
-            ss << "Locks taken=" << sim.p->stats.locks_taken << std::endl;
+            ss << "Clock=" << sim.clk->name() << " Engine="
+               << (sim.is_engine_fixed() ? "fixed" : "generic") << std::endl;
+            ss << "Disk ops=" << sim.disk->stats.ops
+               << " cas retries=" << sim.disk->stats.cas_retries
+               << " stalls=" << sim.disk->stats.stalls;
+            if (!sim.disk->model.get_error().empty())
+                ss << " trace failed, " << sim.disk->model.get_error();
+            if (auto &group = sim.group)
+                ss << " group commits=" << group->stats.groups
+                   << " jobs/commit="
+                   << (double)group->stats.jobs /
+                          std::max(1UL, group->stats.groups.load());
+            ss << std::endl;
+            if (auto &pipe = sim.pipe) {
+                auto bufs = std::max(1UL, pipe->stats.bufs.load());
+                ss << "Compression ratio="
+                   << (double)pipe->stats.raw_bytes /
+                          std::max(1UL, pipe->stats.out_bytes.load())
+                   << " cpu/buf(us)="
+                   << pipe->stats.compress_ns / bufs / 1000.0 << std::endl;
+                if (auto k = pipe->get_kernel())
+                    ss << "Checksum " << k->name << " GB/s="
+                       << (double)pipe->stats.raw_bytes /
+                              std::max(1UL, pipe->stats.checksum_ns.load())
+                       << std::endl;
+                if (!pipe->get_error().empty())
+                    ss << "Flush file " << pipe->get_error() << std::endl;
+                else if (pipe->stats.write_errors)
+                    ss << "Flush file write errors="
+                       << pipe->stats.write_errors << std::endl;
+            }
+            ss << "Total pressure=" << sim.p->total_pressure() << std::endl;
+            for (int g = 1; g < sim.p->ngroups(); ++g) {
+                auto share = sim.p->share(g);
+                ss << "Group " << sim.p->group_path(g)
+                   << " weight=" << sim.p->group_weight(g)
+                   << " pressure=" << share.pressure
+                   << " budget=" << share.budget << std::endl;
+            }
+            ss << "Total free=" << sim.p->published.free << std::endl;
+            ss << "Pool size=" << sim.p->size() << "/" << sim.p->capacity()
+               << " retiring=" << sim.p->retiring() << std::endl;
+            auto nodes = sim.p->arena_nodes();
+            ss << "Buffers by numa node=";
+            for (size_t n = 0; n + 1 < nodes.size(); ++n)
+                ss << nodes[n] << " ";
+            ss << "untouched=" << nodes.back() << std::endl;
+            sim.ui_placement.sample();
+            ss << "Placement " << sim.ui_placement.str() << std::endl;
+            if (auto pl = sim.pipe ? sim.pipe->get_placement() : nullptr)
+                ss << "Placement " << pl->str() << std::endl;
+            ss << "Locks taken=" << sim.p->stats.locks_taken;
+            if (auto &board = sim.board)
+                ss << " donated=" << board->stats.donated << " in "
+                   << board->stats.donations << " donations";
+            ss << std::endl;
+            if (sim.p->nshards() > 1) {
+                for (int k = 0; k < sim.p->nshards(); ++k) {
+                    auto &shard = sim.p->shard(k);
+                    ss << "Shard " << k << " free=" << shard.free
+                       << " locks=" << shard.locks_taken
+                       << " steals=" << shard.steals
+                       << " stolen=" << shard.stolen << std::endl;
+                }
+            }
             ss << "Buffers lost=" << sim.p->stats.bufs_lost << std::endl;
+            ss << "Reserve=" << sim.p->reserve_count() << "/"
+               << sim.p->conf.reserve << " lent=" << sim.p->reserve_lent()
+               << " hits=" << sim.p->stats.reserve_hits
+               << " misses=" << sim.p->stats.reserve_misses << std::endl;
+            if (sim.conf.producer) {
+                unsigned long records = 0, bytes = 0, dropped = 0;
+                for (auto &capuch : sim.get_capuches()) {
+                    auto &stats = capuch->get_port()->stats;
+                    records += stats.records;
+                    bytes += stats.bytes;
+                    dropped += stats.dropped;
+                }
+                ss << "Producer records=" << records << " bytes=" << bytes
+                   << " dropped=" << dropped << std::endl;
+            }
+            if (auto &spill = sim.spill) {
+                if (spill->is_open())
+                    ss << "Spill pending=" << spill->get_pending() << "/"
+                       << spill->get_nslots()
+                       << " spilled=" << spill->stats.spilled
+                       << " drained=" << spill->stats.drained
+                       << " full=" << spill->stats.full << std::endl;
+                else
+                    ss << "Spill failed, " << spill->get_error() << std::endl;
+            }
+            if (sim.p->is_shared())
+                ss << "Shared pool " << sim.p->get_name()
+                   << " procs=" << sim.p->nprocs()
+                   << " recovered=" << sim.p->stats.bufs_recovered << std::endl;
+            else if (!sim.p->get_error().empty())
+                ss << "Shared pool failed, " << sim.p->get_error() << std::endl;
+            if (auto srv = sim.get_coord_server()) {
+                ss << "Coord server " << srv->get_addr() << "=";
+                if (srv->is_listening())
+                    ss << srv->get_nodes() << " nodes, " << srv->get_rounds()
+                       << " rounds" << std::endl;
+                else
+                    ss << "failed" << std::endl;
+            }
+            if (auto node = sim.get_coord_node()) {
+                ss << "Coord node " << node->get_addr() << "="
+                   << (node->is_connected() ? "connected" : "disconnected")
+                   << ", " << node->get_updates() << " updates" << std::endl;
+            }
+            if (auto metrics = sim.get_metrics()) {
+                ss << "Metrics " << metrics->get_path() << "="
+                   << (metrics->is_listening()
+                           ? std::to_string(metrics->get_scrapes()) + " scrapes"
+                           : "failed")
+                   << std::endl;
+            }
         }
-        txt.lines = ss.str();
+        if (!sim.get_checkpoint_status().empty())
+            ss << "Checkpoint " << sim.get_checkpoint_status() << std::endl;
+        if (auto &file = this->scen.file)
+            ss << "Scenario " << file->get_path() << " at "
+               << this->scen.elapsed_ns / 1e9 << "s, " << file->get_done()
+               << "/" << file->get_size()
+               << " done, failed=" << this->scen.failed << std::endl;
+        for (auto &line : this->scen.log)
+            ss << line << std::endl;
+        return ss.str();
     }
 
-    void update_global_conf(nc_win_txt &txt) {
+    std::string global_conf() {
         std::stringstream ss;
         for (auto e : this->sim.conf_map) {
             ss << e.first << ": " << e.second << std::endl;
         }
-        txt.lines = ss.str();
+        return ss.str();
     }
 
-    void update_capuch_view(nc_win_txt &txt) {
+    std::string capuch_view() {
         std::stringstream ss;
         if (!sim.is_running()) {
             ss << "Simulation not running" << std::endl;
@@ -553,20 +3576,21 @@ class view {
             ss << std::setw(5) << "rdy";
             ss << std::setw(4) << "act";
             ss << std::endl;
-            for (auto capuch : this->sim.get_capuches()) {
-                ss << std::setw(3) << capuch.id;
-                ss << std::setw(9) << std::hex << capuch.batch_id << std::dec;
-                ss << std::setw(5) << capuch.thread_state.flush_ready;
-                ss << std::setw(5) << capuch.thread_state.flushing;
-                ss << std::setw(4) << capuch.greed;
-                ss << std::setw(6) << capuch.pressure();
-                ss << std::setw(6) << capuch.quota();
-                ss << std::setw(6) << capuch.nbufs();
-                ss << std::setw(5) << capuch.free_list.size();
-                ss << std::setw(5) << capuch.ready_list.size();
-                ss << std::setw(4)
-                   << (capuch.active_rsc.has_value() ? capuch.active_rsc->id
-                                                     : -1);
+            /* As last published, the rest is the capuch thread's */
+            for (auto &capuch : this->sim.get_capuches()) {
+                auto v = capuch->read_snapshot();
+                ss << std::setw(3) << capuch->id;
+                ss << std::setw(9) << std::hex << v[capuch::pub_batch_id]
+                   << std::dec;
+                ss << std::setw(5) << v[capuch::pub_flush_ready];
+                ss << std::setw(5) << v[capuch::pub_in_flight];
+                ss << std::setw(4) << v[capuch::pub_greed];
+                ss << std::setw(6) << v[capuch::pub_pressure];
+                ss << std::setw(6) << v[capuch::pub_quota];
+                ss << std::setw(6) << v[capuch::pub_nbufs];
+                ss << std::setw(5) << v[capuch::pub_free];
+                ss << std::setw(5) << v[capuch::pub_ready];
+                ss << std::setw(4) << v[capuch::pub_active];
                 ss << std::endl;
             }
 
@@ -575,12 +3599,34 @@ class view {
             ss << std::setw(4) << "run";
             ss << std::setw(5) << "rps";
             ss << std::setw(4) << "pri";
+            ss << " group";
+            ss << std::endl;
+            for (auto &capuch : this->sim.get_capuches()) {
+                ss << std::setw(3) << capuch->id;
+                ss << std::setw(4) << capuch->simulation.running;
+                ss << std::setw(5) << capuch->simulation.ready_per_sec;
+                ss << std::setw(4) << capuch->priority;
+                ss << " " << sim.p->group_path(capuch->tenant);
+                ss << std::endl;
+            }
+
+            ss << "Placement" << std::endl;
+            ss << std::setw(3) << "N";
+            ss << std::setw(6) << "cpus";
+            ss << std::setw(4) << "on";
+            ss << std::setw(5) << "node";
+            ss << std::setw(5) << "fifo";
             ss << std::endl;
-            for (auto capuch : this->sim.get_capuches()) {
-                ss << std::setw(3) << capuch.id;
-                ss << std::setw(4) << capuch.simulation.running;
-                ss << std::setw(5) << capuch.simulation.ready_per_sec;
-                ss << std::setw(4) << capuch.priority;
+            for (auto &capuch : this->sim.get_capuches()) {
+                auto &pl = capuch->placement;
+                auto done = pl.applied();
+                ss << std::setw(3) << capuch->id;
+                ss << std::setw(6) << cpu_list_str(pl.cpus);
+                ss << std::setw(4) << pl.cpu.load();
+                ss << std::setw(5) << done.node;
+                ss << std::setw(5) << done.fifo;
+                if (!done.error.empty())
+                    ss << " " << done.error.substr(1);
                 ss << std::endl;
             }
 
@@ -590,20 +3636,212 @@ class view {
             ss << std::setw(7) << "greed+";
             ss << std::setw(7) << "t-outs";
             ss << std::endl;
-            for (auto capuch : this->sim.get_capuches()) {
-                ss << std::setw(3) << capuch.id;
-                ss << std::setw(7) << capuch.stats.greed_inc;
-                ss << std::setw(7) << capuch.stats.greed_dec;
-                ss << std::setw(7) << capuch.stats.timeout;
+            for (auto &capuch : this->sim.get_capuches()) {
+                auto v = capuch->read_snapshot();
+                ss << std::setw(3) << capuch->id;
+                ss << std::setw(7) << v[capuch::pub_greed_inc];
+                ss << std::setw(7) << v[capuch::pub_greed_dec];
+                ss << std::setw(7) << v[capuch::pub_timeout];
                 ss << std::endl;
             }
         }
-        txt.lines = ss.str();
+        return ss.str();
+    }
+
+    /* What scenarios expect and report on, by name: pool, disk and
+     * simulation figures, then sum., min. and max. of capuch fields across
+     * capuches, e.g. max.greed. Empty if not running. */
+    std::map<std::string, double> scenario_metrics() {
+        std::map<std::string, double> m;
+        if (!this->sim.is_running())
+            return m;
+        auto &p = *this->sim.p;
+        m["capuches"] = this->sim.capuches.size();
+        m["pressure"] = p.total_pressure();
+        m["free"] = p.published.free;
+        m["size"] = p.size();
+        m["reserve"] = p.reserve_count();
+        m["lent"] = p.lent();
+        m["locks"] = p.stats.locks_taken;
+        m["bufs_lost"] = p.stats.bufs_lost;
+        m["reserve_hits"] = p.stats.reserve_hits;
+        m["reserve_misses"] = p.stats.reserve_misses;
+        m["disk_ops"] = this->sim.disk->stats.ops;
+        m["disk_stalls"] = this->sim.disk->stats.stalls;
+        m["disk_backlog_ms"] = this->sim.disk->backlog().count() / 1e6;
+        if (auto &board = this->sim.board) {
+            m["donated"] = board->stats.donated;
+            m["boxless"] = board->stats.boxless;
+        }
+        const std::pair<capuch::published_field, const char *> fields[] = {
+            {capuch::pub_batch_id, "batch_id"},
+            {capuch::pub_greed, "greed"},
+            {capuch::pub_pressure, "pressure"},
+            {capuch::pub_quota, "quota"},
+            {capuch::pub_nbufs, "nbufs"},
+            {capuch::pub_ready, "ready"},
+            {capuch::pub_in_flight, "in_flight"},
+            {capuch::pub_timeout, "timeout"},
+        };
+        bool first = true;
+        for (auto &capuch : this->sim.capuches) {
+            auto v = capuch->read_snapshot();
+            for (auto &[field, name] : fields) {
+                std::string n = name;
+                m["sum." + n] += v[field];
+                m["min." + n] = first ? v[field] : std::min<double>(
+                                                       m["min." + n], v[field]);
+                m["max." + n] = first ? v[field] : std::max<double>(
+                                                       m["max." + n], v[field]);
+            }
+            first = false;
+        }
+        return m;
+    }
+
+    /* Printed headless, else kept for the stats window */
+    void scenario_say(const std::string &line) {
+        if (this->headless) {
+            std::cout << line << std::endl;
+            return;
+        }
+        this->scen.log.push_back(line);
+        if (this->scen.log.size() > 8)
+            this->scen.log.pop_front();
+    }
+    /* Scenario time, moving with the simulation's clock while it runs */
+    long scenario_elapsed() {
+        auto &sc = this->scen;
+        if (!this->sim.is_running())
+            return sc.elapsed_ns;
+        auto &clk = this->sim.get_clock();
+        if (&clk != sc.clk) {
+            sc.clk = &clk;
+            sc.origin = clk.now() - std::chrono::nanoseconds(sc.elapsed_ns);
+        }
+        sc.elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            clk.now() - sc.origin)
+                            .count();
+        return sc.elapsed_ns;
+    }
+    /* Run the entries of the scenario that are due. Under a manual clock
+     * the scenario moves it on to each entry's time itself, so a run is the
+     * same every time. Else entries wait for the clock, run as soon as the
+     * view gets to them after. */
+    void scenario_step() {
+        auto &sc = this->scen;
+        if (!sc.file)
+            return;
+        while (auto e = sc.file->peek()) {
+            long elapsed = this->scenario_elapsed();
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(3) << "@" << e->at_ns / 1e9
+               << "s line " << e->line << ": ";
+            if (e->at_ns > elapsed) {
+                if (this->sim.is_running() && !this->sim.is_manual())
+                    return; /* Not yet */
+                if (!this->sim.is_running()) {
+                    this->scenario_say(ss.str() + "simulation not running");
+                    sc.failed++;
+                    break;
+                }
+                this->sim.advance(
+                    std::chrono::nanoseconds(e->at_ns - elapsed));
+                continue;
+            }
+            auto metrics = this->scenario_metrics();
+            if (e->what == scenario::command) {
+                /* Not another scenario, it would replace this one */
+                if (e->text.rfind("scenario", 0) == 0 ||
+                    !this->command_dispatcher(e->text)) {
+                    this->scenario_say(ss.str() + "refused " + e->text);
+                    sc.failed++;
+                }
+            } else if (e->what == scenario::expect) {
+                auto m = metrics.find(e->text);
+                bool ok = m != metrics.end() &&
+                          scenario::holds(m->second, e->op, e->value);
+                ss << "expect " << e->text << " " << e->op << " " << e->value
+                   << ": ";
+                if (m == metrics.end())
+                    ss << "no such metric";
+                else
+                    ss << std::setprecision(0) << m->second;
+                this->scenario_say(ss.str() + (ok ? " ok" : " FAILED"));
+                sc.failed += !ok;
+            } else {
+                /* Counters with their rate since the last report */
+                static const std::set<std::string> counters = {
+                    "locks",          "bufs_lost",      "reserve_hits",
+                    "reserve_misses", "disk_ops",       "disk_stalls",
+                    "donated",        "sum.batch_id",   "sum.timeout"};
+                double dt = (elapsed - sc.reported_ns) / 1e9;
+                ss << "report " << e->text << std::setprecision(1);
+                for (auto &[name, value] : metrics) {
+                    ss << " " << name << "=" << value;
+                    if (counters.count(name) && dt > 0)
+                        ss << "(" << (value - sc.reported[name]) / dt
+                           << "/s)";
+                }
+                this->scenario_say(ss.str());
+                sc.reported = metrics;
+                sc.reported_ns = elapsed;
+            }
+            sc.file->pop();
+            if (!this->running) /* It quit */
+                return;
+        }
+        std::stringstream ss;
+        ss << "Scenario " << sc.file->get_path() << " done, " << sc.failed
+           << " failed";
+        this->scenario_say(ss.str());
+        sc.file.reset();
+        if (sc.quit_when_done) {
+            this->sim.terminate();
+            this->running = false;
+        }
+    }
+
+    static std::atomic_bool stop_requested;
+    static void stop_hndlr(int sig) { view::stop_requested = true; }
+
+    void headless_command(const std::string &line) {
+        if (line == "help")
+            std::cout << view::help_string;
+        else if (line == "stats")
+            std::cout << this->global_stats() << this->global_conf()
+                      << this->capuch_view();
+        else if (!line.empty() && !this->command_dispatcher(line))
+            std::cerr << "Unknown command: " << line << std::endl;
+        std::cout.flush();
     }
 
   public:
     static std::string help_string;
-    view(simulation &sim) : sim(sim) {}
+    view(simulation &sim, bool headless = false)
+        : sim(sim), headless(headless) {
+        sim.ui_placement.role = "ui";
+    }
+
+    /* Start running the scenario at path, see scenario.hpp. With quit, the
+     * program quits once it is done. False if it cannot be read. */
+    bool run_scenario(const std::string &path, bool quit) {
+        auto file = std::make_unique<scenario>();
+        if (!file->load(path)) {
+            this->scenario_say(file->get_error());
+            return false;
+        }
+        this->scen.file = std::move(file);
+        this->scen.quit_when_done = quit;
+        this->scen.clk = nullptr;
+        this->scen.elapsed_ns = 0;
+        this->scen.failed = 0;
+        this->scen.reported.clear();
+        this->scen.reported_ns = 0;
+        return true;
+    }
+    /* Expectations failed (and commands refused) by the last scenario */
+    int get_scenario_failed() const { return this->scen.failed; }
 
     void main() {
         ncctx nc;
@@ -633,16 +3871,239 @@ class view {
 
         nc.set_focus_to(&input);
         while (this->running) {
-            this->update_global_stats(capuch_stats);
-            this->update_global_conf(global_conf);
-            this->update_capuch_view(capuch_view);
+            this->scenario_step();
+            capuch_stats.lines = this->global_stats();
+            global_conf.lines = this->global_conf();
+            capuch_view.lines = this->capuch_view();
             nc.redraw();
             nc.refresh();
             nc.process_input(getch());
         }
     }
+
+    /* No ncurses: commands are read line by line from stdin, "stats" prints
+     * the windows content. Runs until quit or SIGINT/SIGTERM, EOF on stdin
+     * only stops reading. */
+    void headless_main() {
+        signal(SIGINT, view::stop_hndlr);
+        signal(SIGTERM, view::stop_hndlr);
+
+        std::string buf;
+        bool eof = false;
+        while (this->running && !view::stop_requested) {
+            this->scenario_step();
+            int wait_ms = this->scen.file ? 10 : 500;
+            struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+            if (!this->running || eof || poll(&pfd, 1, wait_ms) <= 0) {
+                if (eof)
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(wait_ms));
+                continue;
+            }
+            char chunk[256];
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n <= 0) {
+                eof = true;
+                continue;
+            }
+            buf.append(chunk, n);
+            size_t nl;
+            while (this->running &&
+                   (nl = buf.find('\n')) != std::string::npos) {
+                this->headless_command(buf.substr(0, nl));
+                buf.erase(0, nl + 1);
+            }
+        }
+        this->sim.terminate();
+    }
+
+    /* Thousands of capuches at a high rate, with commands thrown at them
+     * at random from this thread the way the UI would, while an auditor
+     * thread checks the pool's and capuches' invariants every 10ms, less
+     * often if that would take over a tenth of the time. It audits one
+     * shard at a time, round robin, the other shards carry on. Ends by its
+     * deadline. All capuches are removed at the end: the whole pool is
+     * audited then and every buffer must be back, free or in the reserve.
+     * Prints throughput and the first violation found, false if there was
+     * one. */
+    bool stress_main(long seconds) {
+        signal(SIGINT, view::stop_hndlr);
+        signal(SIGTERM, view::stop_hndlr);
+
+        /* Thousands where there are the CPUs for it */
+        const long ncapuch = std::clamp(
+            250L * std::thread::hardware_concurrency(), 200L, 4000L);
+        auto &sim = this->sim;
+        sim.conf.ncapuch = ncapuch;
+        sim.conf.clock = simulation::clock_scaled;
+        sim.conf.clock_scale = 100;
+        sim.pool_conf.total_rsc = 8 * ncapuch;
+        sim.pool_conf.max_rsc = 0;
+        sim.pool_conf.reserve = 64;
+        sim.pool_conf.shards = 4;
+        sim.start();
+        long base_rsc = sim.pool_conf.total_rsc;
+
+        std::mutex violation_guard;
+        std::string violation;
+        std::atomic_bool auditing = true;
+        std::atomic_ulong audits = 0, audit_ns = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        auto found = [&](const std::string &why) {
+            std::lock_guard<std::mutex> lk(violation_guard);
+            if (violation.empty()) {
+                std::stringstream ss;
+                ss << "at " << std::fixed << std::setprecision(3)
+                   << std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - t0)
+                          .count()
+                   << "s, " << why;
+                violation = ss.str();
+            }
+        };
+        std::thread auditor([&] {
+            std::string why;
+            constexpr std::chrono::milliseconds period{10};
+            std::chrono::nanoseconds idle = period;
+            for (int k = 0; auditing; k = (k + 1) % sim.p->nshards()) {
+                /* In periods, not to hold the end up */
+                for (auto slept = period * 0; slept < idle && auditing;
+                     slept += period)
+                    std::this_thread::sleep_for(period);
+                if (!auditing)
+                    break;
+                auto start = std::chrono::steady_clock::now();
+                if (!sim.p->audit(k, why))
+                    found(why);
+                else if (!sim.audit_capuches(why))
+                    found(why);
+                auto took = std::chrono::steady_clock::now() - start;
+                audits++;
+                audit_ns += std::chrono::duration_cast<
+                                std::chrono::nanoseconds>(took)
+                                .count();
+                idle = std::max<std::chrono::nanoseconds>(period, 9 * took);
+            }
+        });
+
+        std::mt19937 rng(std::random_device{}());
+        auto pick = [&rng](long lo, long hi) {
+            return std::uniform_int_distribution<long>(lo, hi)(rng);
+        };
+        /* Ids of a random run of existing capuches */
+        auto some = [&] {
+            auto &capuches = sim.capuches;
+            long i = pick(0, capuches.size() - 1);
+            long j = std::min<long>(capuches.size() - 1, i + pick(0, 200));
+            return std::to_string(capuches[i]->id) + " " +
+                   std::to_string(capuches[j]->id);
+        };
+        this->command_dispatcher("capuch " + some() + " speed 200");
+        unsigned long commands = 0;
+        auto end = t0 + std::chrono::seconds(seconds);
+        while (std::chrono::steady_clock::now() < end &&
+               !view::stop_requested) {
+            std::string cmd;
+            switch (pick(0, 11)) {
+            case 0:
+            case 1:
+                cmd = "capuch " + some() + " priority " +
+                      std::to_string(pick(1, 100));
+                break;
+            case 2:
+            case 3:
+                cmd = "capuch " + some() + " speed " +
+                      std::to_string(pick(0, 2000));
+                break;
+            case 4:
+                cmd = "disk-flush";
+                break;
+            case 5:
+                cmd = "conf pool_conf.flush_size " +
+                      std::to_string(pick(1, 16));
+                break;
+            case 6:
+                cmd = "conf pool_conf." +
+                      std::string(pick(0, 1) ? "greed_ctl " : "donate ") +
+                      std::to_string(pick(0, 1));
+                break;
+            case 7:
+                cmd = "conf pool_conf.min_bufs " + std::to_string(pick(0, 4));
+                break;
+            case 8:
+                cmd = "conf pool_conf.total_rsc " +
+                      std::to_string(pick(base_rsc / 2, 2 * base_rsc));
+                break;
+            case 9:
+                cmd = "group /g" + std::to_string(pick(0, 7)) + " " +
+                      std::to_string(pick(1, 10));
+                this->command_dispatcher(cmd);
+                cmd = "capuch " + some() + " group /g" +
+                      std::to_string(pick(0, 7));
+                break;
+            case 10:
+                if ((long)sim.capuches.size() > ncapuch)
+                    cmd = "capuch remove " + some();
+                else
+                    cmd = "capuch add " + std::to_string(pick(1, 20));
+                break;
+            default: /* What the UI does in between */
+                this->global_stats();
+                this->capuch_view();
+                break;
+            }
+            if (!cmd.empty() && !this->command_dispatcher(cmd))
+                found("command refused: " + cmd);
+            commands++;
+        }
+        double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - t0)
+                             .count();
+        auditing = false;
+        auditor.join();
+
+        unsigned long ops = sim.disk->stats.ops, lost = sim.p->stats.bufs_lost;
+        unsigned long locks = sim.p->stats.locks_taken;
+        long left = sim.capuches.size();
+        sim.remove_capuches(0, sim.next_capuch_id);
+        std::string why;
+        long free = 0;
+        for (int k = 0; k < sim.p->nshards(); ++k)
+            free += sim.p->shard(k).free;
+        if (!sim.p->audit(why))
+            found(why);
+        else if (free + sim.p->reserve_count() != sim.p->size())
+            found("all capuches removed, free=" + std::to_string(free) +
+                  " reserve=" + std::to_string(sim.p->reserve_count()) +
+                  " size=" + std::to_string(sim.p->size()));
+        else if (sim.p->lent() || sim.p->total_pressure())
+            found("all capuches removed, lent=" +
+                  std::to_string(sim.p->lent()) + " pressure=" +
+                  std::to_string(sim.p->total_pressure()));
+        sim.terminate();
+
+        std::cout << std::fixed << std::setprecision(0);
+        std::cout << "Stress " << elapsed << "s: " << left << " capuches, "
+                  << commands << " commands (" << commands / elapsed
+                  << "/s)" << std::endl;
+        std::cout << "Disk ops=" << ops << " (" << ops / elapsed
+                  << "/s) bufs lost=" << lost << " (" << lost / elapsed
+                  << "/s) locks taken=" << locks << " (" << locks / elapsed
+                  << "/s)" << std::endl;
+        std::cout << std::setprecision(1) << "Audits=" << audits
+                  << " mean(us)="
+                  << audit_ns / 1000.0 / std::max(1UL, audits.load())
+                  << std::endl;
+        if (!violation.empty())
+            std::cout << "First violation " << violation << std::endl;
+        else
+            std::cout << "No violation" << std::endl;
+        return violation.empty();
+    }
 };
 
+std::atomic_bool view::stop_requested = false;
+
 /* clang-format off */
 std::string view::help_string = 
 "! Type help again to go back\n"
@@ -657,22 +4118,279 @@ std::string view::help_string =
 "  term => stop simulation\n"
 "  quit => close the program\n"
 "  capuch START END (speed|priority) VALUE => set capuch speed/priority\n"
+"  capuch START END group PATH => move capuches to a group, e.g. /web/api\n"
+"  group PATH WEIGHT => add a group (and its parents), set its weight\n"
+"  capuch add N => attach N more capuches to the running simulation\n"
+"  capuch remove START END => detach capuches, their ready buffers are\n"
+"    flushed and all their buffers and pressure go back to the pool\n"
 "  conf FIELD VALUE => set conf FIELD to VALUE\n"
 "    use any conf field fron the configuration window\n"
 "    example: pool_conf.min_bufs\n"
 "    note: some fields will take effect only after sim stop\n"
 "  disk-flush => flush all disk IO immediately\n"
+"  clock advance NS => move manual clock NS forward, stepping all capuches\n"
+"  save FILE => pause, checkpoint the simulation to FILE, resume\n"
+"  load FILE => replace the simulation with the one checkpointed in FILE\n"
+"  scenario FILE => run the timed commands and checks of FILE\n"
+"\n"
+"Clock (conf.clock, on the next start):\n"
+"  0 => real, 1 => coarse (cheaper, ~ms resolution),\n"
+"  2 => scaled by conf.clock_scale, 3 => manual (single threaded, stepped)\n"
+"\n"
+"Compression:\n"
+"  conf disk_conf.compress 1 => on the next start, LZ compress flush batches\n"
+"    on a worker thread, the disk is charged for compressed bytes only\n"
+"  conf disk_conf.checksum 1|2 => on the next start, checksum each flushed\n"
+"    buffer, 1 => crc32c, 2 => xh32 (xxhash style), fastest CPU kernel\n"
+"  --flush-file PATH => write flushed buffers to PATH, check it with\n"
+"    --verify PATH, --bench shows checksum and compression GB/s per core\n"
+"\n"
+"Group commit:\n"
+"  conf disk_conf.group_commit 1 => on the next start, flushes of all\n"
+"    capuches are collected for up to disk_conf.group_window_ms or\n"
+"    disk_conf.group_max_bufs buffers, then written as one disk job\n"
+"  conf disk_conf.op_cost_us US => fixed cost of every disk job\n"
+"\n"
+"Disk model:\n"
+"  conf disk_conf.jitter_dist 0-4 => extra service time of each job, none,\n"
+"    exponential, lognormal or pareto with mean disk_conf.jitter_us and\n"
+"    sigma/alpha disk_conf.jitter_shape_pct / 100, or 4 => replayed from\n"
+"    --disk-trace PATH (microseconds, one per line)\n"
+"  conf disk_conf.stall_ms MS => length of disk stalls, every\n"
+"    disk_conf.stall_every_ms and disk_conf.stall_rate_per_min at random\n"
+"  conf disk_conf.qd_saturation N => full bandwidth only with N jobs queued\n"
+"\n"
+"Groups:\n"
+"  The pool's buffers are split between groups by weight, within a group\n"
+"    by capuch pressure as usual. A group's own capuches count as one more\n"
+"    subgroup of weight 1. Groups with no pressure lend their share to the\n"
+"    others. Capuches start in the root group /\n"
+"\n"
+"Pool shards:\n"
+"  conf pool_conf.shards N => on the next start, split the free buffers in\n"
+"    N lists with a lock each, 0 is one per numa node. Capuches use the\n"
+"    one of their node (conf.numa, pinned) or round robin, and steal in\n"
+"    bulk from the fullest other shard when theirs runs dry\n"
+"\n"
+"Greed controller:\n"
+"  conf pool_conf.greed_ctl 0|1 => one greed step per starvation or timeout,\n"
+"    or straight to the level covering EWMA fill rate times flush latency\n"
+"    and burst gap, falling once the need is pool_conf.greed_headroom_pct\n"
+"    below what it was set for\n"
+"\n"
+"Donation:\n"
+"  conf pool_conf.donate 0|1 => capuches over quota give spare buffers to\n"
+"    the one short of the most through lock-free mailboxes, the pool only\n"
+"    gets what nobody wants\n"
+"\n"
+"Emergency reserve:\n"
+"  conf pool_conf.reserve N => N buffers kept out of every quota, on a\n"
+"    lock-free stack a capuch out of buffers takes from before overwriting\n"
+"    its oldest ready one. Refilled from the pool as pressure drops\n"
+"\n"
+"Checkpoint:\n"
+"  save keeps the conf, groups, pool, every capuch's buffers, greed, batch\n"
+"    ids and timers (as offsets from the clock), and the disk backlog, not\n"
+"    buffer contents. Not with a shared pool, flush pipeline, group commit,\n"
+"    spill file or producer ports. The outcome shows in the stats\n"
+"\n"
+"Scenario:\n"
+"  One entry per line, [@TIME | +TIME] then a command, expect METRIC OP\n"
+"    VALUE or report LABEL. @ is from the start, + from the entry before,\n"
+"    TIME in ns, us, ms or s. OP is < <= > >= == !=. METRIC is a report\n"
+"    field: pool and disk figures, or sum., min., max. of a capuch field\n"
+"    e.g. max.greed. With conf.clock 3 the scenario advances the clock\n"
+"    itself, so a run is repeatable. --headless --scenario PATH exits 1\n"
+"    if an expect failed\n"
+"\n"
+"Engines:\n"
+"  conf conf.engine 0|1 => capuches step with the generic engine, or one\n"
+"    built with pool_conf.min_greed, max_greed, flush_size, greed_ctl and\n"
+"    the clock as constants when they match (make ENGINE_CONF=MIN,MAX,SIZE\n"
+"    for other values), the stats show which. --bench compares them\n"
+"\n"
+"Pool resize:\n"
+"  conf pool_conf.total_rsc N => grow or shrink the running pool, up to\n"
+"    pool_conf.max_rsc (set before start, 0 is 4 times total_rsc). Buffers\n"
+"    above N are given back to the OS as their capuches release them\n"
+"\n"
+"Producer port:\n"
+"  conf conf.producer 1 => on the next start, the trace of each capuch is\n"
+"    written record by record in place through its producer_port, the API\n"
+"    for tracers embedding capuchinos: reserve, write, commit. A full\n"
+"    buffer is ready, out of buffers records are dropped, not overwritten\n"
+"\n"
+"Overflow spill:\n"
+"  conf disk_conf.spill_bufs N => on the next start, preallocate a memory\n"
+"    mapped file of N buffers. Instead of losing the oldest ready buffer, a\n"
+"    capuch out of buffers copies it there. Spilled batches go to the disk\n"
+"    while its backlog is below disk_conf.spill_drain_ms. The file is\n"
+"    /tmp/capuchinos-PID.spill or the one given with --spill-file PATH\n"
+"\n"
+"Placement:\n"
+"  affinity capuch|flusher|ui LIST => pin threads to CPUs, e.g. 0-3,8.\n"
+"    Capuches take one CPU of the list each, round robin, on their start.\n"
+"    The flusher on the next start, the UI right away. Empty LIST is any\n"
+"  conf conf.numa 1 => worker threads take memory (and first touch pool\n"
+"    buffers) from their node, on machines with several numa nodes\n"
+"  conf conf.sched_fifo PRIO => run worker threads SCHED_FIFO, if allowed\n"
+"\n"
+"Rack coordination (conf.coord_period_ms, conf.coord_budget):\n"
+"  coord serve ADDR => run the coordinator, ADDR is unix:PATH or HOST:PORT\n"
+"  coord join ADDR => let the coordinator set pool_conf.total_rsc/reserve\n"
+"  coord stop => leave (restoring pool_conf) and stop serving\n"
+"  --coord-check => check the split and a loopback server with two nodes\n"
+"\n"
+"Shared pool:\n"
+"  conf conf.shm 1 => on the next start attach to (or create) the pool in\n"
+"    shared memory /capuchinos, or the one given with --shm NAME. Several\n"
+"    processes share its buffers, each running its own capuches and disk.\n"
+"    The creator's pool_conf.total_rsc/reserve/buf_size win.\n"
+"\n"
+"Metrics:\n"
+"  conf conf.metrics 1 => serve OpenMetrics on the next start\n"
+"    read with: socat - UNIX-CONNECT:/tmp/capuchinos.sock\n"
+"    path can be changed with --metrics PATH command line option\n"
 ;
 /* clang-format on */
 
-int main() {
+/* Capuch events (ready buffers, flush starts and finishes, timeouts) per
+ * second, stepped by the generic then the fixed engine. On a manual clock,
+ * so that both handle the very same events. Best of a few runs. */
+/* False if the engines did not count the same events */
+static bool engine_bench(std::ostream &os) {
+    constexpr int ncapuch = 64, ready_per_sec = 500, seconds = 60;
+    os << "Capuch engines, " << ncapuch << " capuches, Mevents/s"
+#ifdef __OPTIMIZE__
+       << ", optimized build"
+#else
+       << ", unoptimized build"
+#endif
+       << std::endl;
+    double best[2] = {};
+    long events[2] = {};
+    for (int run = 0; run < 6; ++run) {
+        int fixed = run % 2;
+        simulation sim;
+        sim.conf.clock = simulation::clock_manual;
+        sim.conf.ncapuch = ncapuch;
+        sim.conf.engine = fixed;
+        /* Keeping up, or buffers lost would be most of the work. A second
+         * of ready buffers comes at once, see capuch::step(). */
+        sim.disk_conf.consume_per_second = 4 * ncapuch * ready_per_sec;
+        sim.pool_conf.total_rsc = 4 * ncapuch * ready_per_sec;
+        sim.pool_conf.max_rsc = sim.pool_conf.total_rsc.load();
+        sim.start();
+        for (auto &c : sim.get_capuches())
+            c->simulation.ready_per_sec = ready_per_sec;
+        auto start = std::chrono::steady_clock::now();
+        sim.advance(std::chrono::seconds(seconds));
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        events[fixed] = 0;
+        for (auto &c : sim.get_capuches()) {
+            auto v = c->read_snapshot();
+            events[fixed] += (long)ready_per_sec * seconds +
+                             2 * v[capuch::pub_batch_id] +
+                             v[capuch::pub_timeout];
+        }
+        best[fixed] =
+            std::max(best[fixed], events[fixed] / elapsed.count() / 1e6);
+    }
+    os << "  generic: " << best[0] << std::endl;
+    os << "  fixed: " << best[1] << " (" << std::showpos
+       << (best[1] / best[0] - 1) * 100 << std::noshowpos << "%)"
+       << std::endl;
+    if (events[0] != events[1]) {
+        os << "  engines disagree: generic " << events[0] << " events, fixed "
+           << events[1] << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog
+              << " [--headless] [--metrics PATH] [--shm NAME]"
+                 " [--flush-file PATH] [--spill-file PATH]"
+                 " [--disk-trace PATH] [--scenario PATH]"
+              << std::endl;
+    std::cerr << "       " << prog << " --verify PATH | --bench | --coord-check"
+              << std::endl;
+    std::cerr << "       " << prog << " --stress SECONDS" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    bool headless = false;
+    long stress = 0;
+    std::optional<std::string> metrics_path;
+    std::optional<std::string> shm_name;
+    std::optional<std::string> flush_path;
+    std::optional<std::string> spill_path;
+    std::optional<std::string> disk_trace_path;
+    std::optional<std::string> scenario_path;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (!strcmp(argv[i], "--shm") && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (!strcmp(argv[i], "--flush-file") && i + 1 < argc) {
+            flush_path = argv[++i];
+        } else if (!strcmp(argv[i], "--spill-file") && i + 1 < argc) {
+            spill_path = argv[++i];
+        } else if (!strcmp(argv[i], "--disk-trace") && i + 1 < argc) {
+            disk_trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "--scenario") && i + 1 < argc) {
+            scenario_path = argv[++i];
+        } else if (!strcmp(argv[i], "--verify") && i + 1 < argc) {
+            return flush_verify(argv[i + 1], std::cout) ? 1 : 0;
+        } else if (!strcmp(argv[i], "--stress") && i + 1 < argc) {
+            stress = std::max(1L, atol(argv[++i]));
+        } else if (!strcmp(argv[i], "--coord-check")) {
+            return coord_check(std::cout) ? 0 : 1;
+        } else if (!strcmp(argv[i], "--bench")) {
+            flush_bench(std::cout);
+            counter_bench(std::cout);
+            return engine_bench(std::cout) ? 0 : 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
+    int rc = 0;
     {
         simulation sim;
-        view view(sim);
+        if (metrics_path) {
+            sim.metrics_path = *metrics_path;
+            sim.conf.metrics = 1;
+        }
+        if (shm_name) {
+            sim.shm_name = *shm_name;
+            sim.conf.shm = 1;
+        }
+        if (flush_path)
+            sim.flush_path = *flush_path;
+        if (spill_path)
+            sim.spill_path = *spill_path;
+        if (disk_trace_path)
+            sim.disk_trace_path = *disk_trace_path;
+        view view(sim, headless);
 
-        view.main();
+        if (stress)
+            return view.stress_main(stress) ? 0 : 1;
+        /* Headless, the program is the scenario: quit once it is done */
+        if (scenario_path && !view.run_scenario(*scenario_path, headless))
+            return 1;
+        if (headless)
+            view.headless_main();
+        else
+            view.main();
+        rc = view.get_scenario_failed() ? 1 : 0;
     }
 
     std::cout << "The end" << std::endl;
+    return rc;
 }
@@ -0,0 +1,148 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+void counter_bench(std::ostream &os) {
+    const int nthreads = std::max(2U, std::thread::hardware_concurrency());
+    constexpr long ops = 5000000;
+    auto run = [nthreads](const std::function<void(int)> &body) {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < nthreads; ++t)
+            threads.emplace_back(body, t);
+        for (auto &t : threads)
+            t.join();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        return nthreads * ops / elapsed.count() / 1e6;
+    };
+
+    std::atomic_ulong one{0};
+    std::unique_ptr<std::atomic_ulong[]> packed(
+        new std::atomic_ulong[nthreads]());
+    sharded_counter sharded;
+
+    os << "Counters, " << nthreads << " threads, Mops/s" << std::endl;
+    os << "  one atomic: " << run([&](int) {
+        for (long i = 0; i < ops; ++i)
+            one.fetch_add(1, std::memory_order_relaxed);
+    }) << std::endl;
+    os << "  packed atomics: " << run([&](int t) {
+        for (long i = 0; i < ops; ++i)
+            packed[t].fetch_add(1, std::memory_order_relaxed);
+    }) << std::endl;
+    os << "  sharded_counter: " << run([&](int) {
+        for (long i = 0; i < ops; ++i)
+            sharded++;
+    }) << std::endl;
+    if (one != (unsigned long)nthreads * ops || sharded.load() != one)
+        os << "  MISMATCH" << std::endl;
+}
+
+void histogram::render(std::ostream &os, const std::string &name,
+                       const std::string &labels) const {
+    const std::string sep = labels.empty() ? "" : ",";
+    unsigned long cumulative = 0;
+    for (int i = 0; i <= nbuckets; ++i) {
+        cumulative += this->buckets[i].load(std::memory_order_relaxed);
+        os << name << "_bucket{" << labels << sep << "le=\"";
+        if (i < nbuckets)
+            os << (double)(1UL << i) / 1000;
+        else
+            os << "+Inf";
+        os << "\"} " << cumulative << "\n";
+    }
+    os << name << "_count{" << labels << "} " << cumulative << "\n";
+    os << name << "_sum{" << labels << "} "
+       << (double)this->sum_ns.load(std::memory_order_relaxed) / 1e9 << "\n";
+}
+
+metrics_server::metrics_server(const std::string &path,
+                               std::function<std::string()> render)
+    : path(path), render(render) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    this->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (this->fd < 0)
+        return;
+    unlink(path.c_str()); /* Stale socket of a previous run */
+    if (bind(this->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(this->fd, 8)) {
+        close(this->fd);
+        this->fd = -1;
+        return;
+    }
+
+    this->listening = true;
+    this->running = true;
+    this->thread = std::thread(&metrics_server::main, this);
+}
+
+metrics_server::~metrics_server() {
+    this->running = false;
+    if (this->thread.joinable())
+        this->thread.join();
+    if (this->fd >= 0) {
+        close(this->fd);
+        unlink(this->path.c_str());
+    }
+}
+
+void metrics_server::main() {
+    while (this->running) {
+        struct pollfd pfd = {.fd = this->fd, .events = POLLIN};
+        /* Short timeout, so destruction does not wait for a scraper */
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        int cfd = accept4(this->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0)
+            continue;
+        this->serve(cfd);
+        close(cfd);
+    }
+}
+
+void metrics_server::serve(int cfd) {
+    /* Peek at the request, if the client sends one at all */
+    char req[512];
+    ssize_t len = 0;
+    struct pollfd pfd = {.fd = cfd, .events = POLLIN};
+    if (poll(&pfd, 1, 100) > 0)
+        len = recv(cfd, req, sizeof(req), 0);
+    bool http = len >= 4 && !memcmp(req, "GET ", 4);
+
+    std::string body = this->render();
+    std::string out;
+    if (http) {
+        std::stringstream hdr;
+        hdr << "HTTP/1.0 200 OK\r\n"
+            << "Content-Type: application/openmetrics-text; version=1.0.0; "
+               "charset=utf-8\r\n"
+            << "Content-Length: " << body.size() << "\r\n\r\n";
+        out = hdr.str();
+    }
+    out += body;
+
+    size_t off = 0;
+    while (off < out.size()) {
+        ssize_t n = send(cfd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    this->scrapes++;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/* Sequence lock for single writer, many readers snapshots. Fields guarded by
+ * it must be atomics themselves (relaxed is enough), the lock only makes sure
+ * a reader sees all of them from the same publication. Readers never block
+ * the writer. */
+class seqlock {
+  private:
+    std::atomic_uint seq = 0;
+
+  public:
+    void write_begin() {
+        this->seq.store(this->seq.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void write_end() {
+        this->seq.store(this->seq.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+    }
+    unsigned read_begin() const {
+        unsigned s;
+        while ((s = this->seq.load(std::memory_order_acquire)) & 1)
+            std::this_thread::yield();
+        return s;
+    }
+    bool read_retry(unsigned s) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return this->seq.load(std::memory_order_relaxed) != s;
+    }
+};
+
+constexpr size_t cache_line = 64;
+
+/* Counter bumped by many threads. Each thread adds to its own cache line
+ * sized shard (threads are given shards in the order they first count) and
+ * readers sum the shards, so writers never bounce a line between them.
+ * Zero initialized and pointer free: it may live in shared memory too. */
+class sharded_counter {
+  public:
+    static constexpr int nshards = 16;
+
+  private:
+    struct alignas(cache_line) shard {
+        std::atomic_ulong v{0};
+    };
+    shard shards[nshards];
+
+    static inline std::atomic_int next_shard{0};
+    static int this_shard() {
+        static thread_local int shard =
+            next_shard.fetch_add(1, std::memory_order_relaxed) % nshards;
+        return shard;
+    }
+
+  public:
+    void add(unsigned long n) {
+        this->shards[this_shard()].v.fetch_add(n, std::memory_order_relaxed);
+    }
+    void operator++(int) { this->add(1); }
+    void operator+=(unsigned long n) { this->add(n); }
+    unsigned long load() const {
+        unsigned long sum = 0;
+        for (auto &s : this->shards)
+            sum += s.v.load(std::memory_order_relaxed);
+        return sum;
+    }
+    operator unsigned long() const { return this->load(); }
+};
+
+/* Increments per second from several threads on one atomic, on atomics
+ * packed in a line (false sharing) and on a sharded_counter */
+void counter_bench(std::ostream &os);
+
+/* Latency histogram with power of 2 millisecond buckets: le=1ms .. 2^N ms and
+ * +Inf. Observations are relaxed atomic increments, so any thread may render
+ * it at any time without synchronizing with the observer. */
+class histogram {
+  public:
+    static constexpr int nbuckets = 16;
+
+  private:
+    std::array<std::atomic_ulong, nbuckets + 1> buckets{};
+    std::atomic_ulong sum_ns = 0;
+
+  public:
+    void observe(unsigned long ns) {
+        int i = 0;
+        while (i < nbuckets && ns > (1000000UL << i))
+            ++i;
+        this->buckets[i].fetch_add(1, std::memory_order_relaxed);
+        this->sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    /* Render samples (not the TYPE line) of an OpenMetrics histogram.
+     * Labels are given without braces, e.g. capuch="3". */
+    void render(std::ostream &os, const std::string &name,
+                const std::string &labels) const;
+};
+
+/* Minimal OpenMetrics endpoint over a Unix domain stream socket. Each accepted
+ * connection gets one exposition produced by render() and is closed. Plain
+ * HTTP GET requests are answered with an HTTP/1.0 response, anything else
+ * (e.g. `socat - UNIX-CONNECT:PATH`) gets the raw text. */
+class metrics_server {
+  private:
+    std::string path;
+    std::function<std::string()> render;
+    std::atomic_bool running = false;
+    std::atomic_bool listening = false;
+    std::atomic_ulong scrapes = 0;
+    int fd = -1;
+    std::thread thread;
+
+    void main();
+    void serve(int cfd);
+
+  public:
+    metrics_server(const std::string &path,
+                   std::function<std::string()> render);
+    ~metrics_server();
+
+    const std::string &get_path() const { return this->path; }
+    bool is_listening() const { return this->listening; }
+    unsigned long get_scrapes() const { return this->scrapes; }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cassert>
+
+/* Buffers passed from one thread to another, in order. Single producer,
+ * single consumer, both ends wait-free. */
+class buffer_ring {
+  public:
+    static constexpr unsigned capacity = 16; /* Power of 2 */
+
+    struct slot {
+        int id;
+        char *data;
+        long used; /* Bytes written */
+    };
+
+  private:
+    alignas(cache_line) std::atomic_uint head{0}; /* Consumer */
+    alignas(cache_line) std::atomic_uint tail{0}; /* Producer */
+    slot slots[capacity];
+
+  public:
+    /* False if full */
+    bool push(const slot &s) {
+        unsigned tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == capacity)
+            return false;
+        this->slots[tail % capacity] = s;
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    /* False if empty */
+    bool pop(slot &s) {
+        unsigned head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail.load(std::memory_order_acquire))
+            return false;
+        s = this->slots[head % capacity];
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/* Where a tracer embedding capuchinos writes its records: reserve room in
+ * the current buffer, write the record there, commit it. A full buffer goes
+ * to the capuch as ready, to be flushed from where it was written, and the
+ * next one it staged takes over.
+ * One producer thread per port, wait-free: with no buffer staged reserve()
+ * fails, the record is the producer's to drop, and is counted. The capuch
+ * stages more as it runs, see capuch::on_produced(). */
+class producer_port {
+  private:
+    buffer_ring staged; /* Capuch to producer, empty */
+    buffer_ring filled; /* Producer to capuch */
+    long buf_size;
+
+    /* Producer only */
+    alignas(cache_line) buffer_ring::slot cur = {-1, nullptr, 0};
+    long reserved = 0;
+
+  public:
+    struct {
+        std::atomic_ulong records{0};
+        std::atomic_ulong bytes{0};
+        std::atomic_ulong dropped{0}; /* Records with nowhere to go */
+    } stats;
+
+    producer_port(long buf_size) : buf_size(buf_size) {}
+
+  public: /* Producer */
+    /* Room for n bytes, nullptr if there is none. Hands the current buffer
+     * over and moves to the next if it has less than n left. */
+    char *reserve(long n) {
+        assert(!this->reserved);
+        if (this->cur.id >= 0 && this->cur.used + n > this->buf_size &&
+            this->filled.push(this->cur))
+            this->cur.id = -1;
+        if (this->cur.id < 0)
+            this->staged.pop(this->cur);
+        if (this->cur.id < 0 || this->cur.used + n > this->buf_size) {
+            this->stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        this->reserved = n;
+        return this->cur.data + this->cur.used;
+    }
+    /* The n first bytes reserved are written, n may be less than reserved */
+    void commit(long n) {
+        assert(n <= this->reserved);
+        this->cur.used += n;
+        this->reserved = 0;
+        this->stats.records.fetch_add(1, std::memory_order_relaxed);
+        this->stats.bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+    /* Hand the current buffer over even if not full, e.g. going idle */
+    void flush() {
+        if (this->cur.id >= 0 && this->cur.used && this->filled.push(this->cur))
+            this->cur.id = -1;
+    }
+
+  public: /* Capuch */
+    /* Never fails with fewer than capacity buffers handed out */
+    void stage(int id, char *data) {
+        bool ok = this->staged.push({id, data, 0});
+        assert(ok);
+        (void)ok;
+    }
+    /* Next buffer the producer handed over, in the order they were staged */
+    bool take(buffer_ring::slot &s) { return this->filled.pop(s); }
+};
@@ -0,0 +1,96 @@
+#include "scenario.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+/* Nanoseconds of a TIME, -1 if it is not one */
+static long parse_time(const std::string &s) {
+    char *end;
+    double t = strtod(s.c_str(), &end);
+    double unit = 1e9;
+    if (!strcmp(end, "ns"))
+        unit = 1;
+    else if (!strcmp(end, "us"))
+        unit = 1e3;
+    else if (!strcmp(end, "ms"))
+        unit = 1e6;
+    else if (*end && strcmp(end, "s"))
+        return -1;
+    if (end == s.c_str() || t < 0)
+        return -1;
+    return t * unit;
+}
+
+bool scenario::load(const std::string &path) {
+    std::ifstream f(path);
+    if (!f) {
+        this->error = path + ": cannot read";
+        return false;
+    }
+    std::vector<entry> entries;
+    std::string line;
+    long at = 0;
+    for (int n = 1; std::getline(f, line); ++n) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream ss(line);
+        std::string word;
+        if (!(ss >> word))
+            continue;
+        auto bad = [&](const std::string &why) {
+            this->error = path + ":" + std::to_string(n) + ": " + why;
+            return false;
+        };
+        if (word[0] == '@' || word[0] == '+') {
+            long t = parse_time(word.substr(1));
+            if (t < 0)
+                return bad("bad time " + word);
+            if (word[0] == '+')
+                t += at;
+            if (t < at)
+                return bad("back in time");
+            at = t;
+            if (!(ss >> word))
+                return bad("nothing to do");
+        }
+
+        entry e = {at, n, command, "", "", 0};
+        if (word == "expect") {
+            e.what = expect;
+            static const std::set<std::string> ops = {"<",  "<=", ">",
+                                                      ">=", "==", "!="};
+            if (!(ss >> e.text >> e.op >> e.value) || !ops.count(e.op))
+                return bad("expect METRIC OP VALUE");
+        } else if (word == "report") {
+            e.what = report;
+            std::getline(ss >> std::ws, e.text);
+        } else {
+            std::getline(ss, e.text);
+            e.text = word + e.text;
+        }
+        entries.push_back(e);
+    }
+    this->path = path;
+    this->entries = entries;
+    this->next = 0;
+    this->error.clear();
+    return true;
+}
+
+bool scenario::holds(double value, const std::string &op, double against) {
+    if (op == "<")
+        return value < against;
+    if (op == "<=")
+        return value <= against;
+    if (op == ">")
+        return value > against;
+    if (op == ">=")
+        return value >= against;
+    if (op == "==")
+        return value == against;
+    if (op == "!=")
+        return value != against;
+    return false;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* A scenario file: commands at given simulation times, with expectations on
+ * metrics and reports of them in between. One entry per line:
+ *
+ *   [@TIME | +TIME] COMMAND
+ *   [@TIME | +TIME] expect METRIC OP VALUE
+ *   [@TIME | +TIME] report LABEL
+ *
+ * @TIME is from the start of the scenario, +TIME from the previous entry,
+ * none is at the previous entry's time. TIME is a number with ns, us, ms or
+ * s (the default). OP is one of < <= > >= == !=. # starts a comment.
+ * Parsing only, the view runs the entries, see view::scenario_step(). */
+class scenario {
+  public:
+    enum kind { command, expect, report };
+
+    struct entry {
+        long at_ns;
+        int line; /* In the file, for messages */
+        kind what;
+        std::string text; /* Command, metric or label */
+        std::string op;
+        double value;
+    };
+
+  private:
+    std::string path;
+    std::vector<entry> entries;
+    size_t next = 0;
+    std::string error;
+
+  public:
+    /* False with get_error() set on the first line it cannot parse */
+    bool load(const std::string &path);
+
+    /* Next entry to run, nullptr once all have */
+    const entry *peek() const {
+        return this->next < this->entries.size() ? &this->entries[this->next]
+                                                 : nullptr;
+    }
+    void pop() { this->next++; }
+
+    /* value OP against, false for an unknown OP */
+    static bool holds(double value, const std::string &op, double against);
+
+    const std::string &get_path() const { return this->path; }
+    const std::string &get_error() const { return this->error; }
+    size_t get_done() const { return this->next; }
+    size_t get_size() const { return this->entries.size(); }
+};
@@ -0,0 +1,112 @@
+#include "shm.hpp"
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void pool_mutex::init(bool pshared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pshared)
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&this->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    this->died = false;
+}
+
+void pool_mutex::destroy() { pthread_mutex_destroy(&this->m); }
+
+void pool_mutex::lock() {
+    int rc = pthread_mutex_lock(&this->m);
+    if (rc == EOWNERDEAD) {
+        this->died = true;
+        pthread_mutex_consistent(&this->m);
+    } else {
+        assert(!rc);
+    }
+}
+
+void pool_mutex::unlock() { pthread_mutex_unlock(&this->m); }
+
+shm_segment::~shm_segment() {
+    if (this->addr)
+        munmap(this->addr, this->size);
+}
+
+bool shm_segment::map_private(size_t size) {
+    assert(!this->addr);
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    this->addr = addr;
+    this->size = size;
+    return true;
+}
+
+bool shm_segment::map_shared(const std::string &name, size_t size) {
+    assert(!this->addr);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        this->created = true;
+        if (ftruncate(fd, size)) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0)
+            return false;
+        /* The creator may not have sized it yet */
+        struct stat st = {};
+        for (int i = 0; i < 100; ++i) {
+            if (fstat(fd, &st) || st.st_size)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (!st.st_size) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+    } else {
+        return false;
+    }
+
+    void *addr =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        if (this->created)
+            shm_unlink(name.c_str());
+        return false;
+    }
+    this->name = name;
+    this->addr = addr;
+    this->size = size;
+    return true;
+}
+
+void shm_segment::discard(size_t off, size_t len) {
+    auto page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (off + page - 1) / page * page;
+    size_t end = (off + len) / page * page;
+    if (start >= end || end > this->size)
+        return;
+    /* Shared memory pages only go away when punched out of the object */
+    madvise((char *)this->addr + start, end - start,
+            this->is_shared() ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+void shm_segment::unlink() {
+    if (this->is_shared())
+        shm_unlink(this->name.c_str());
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <pthread.h>
+
+/* Mutex that may live in shared memory. Always robust: if the owner dies
+ * while holding it, the next lock() succeeds and owner_died() tells the
+ * caller the protected state has to be repaired. */
+class pool_mutex {
+  private:
+    pthread_mutex_t m;
+    bool died = false; /* Protected by m itself */
+
+  public:
+    void init(bool pshared);
+    void destroy();
+    void lock();
+    void unlock();
+    /* Returns (and clears) whether the previous owner died holding it */
+    bool owner_died() {
+        bool rv = this->died;
+        this->died = false;
+        return rv;
+    }
+};
+
+/* A memory mapping, either private anonymous or a named POSIX shared memory
+ * object shared with other processes. */
+class shm_segment {
+  private:
+    std::string name;
+    void *addr = nullptr;
+    size_t size = 0;
+    bool created = false;
+
+  public:
+    shm_segment() {}
+    shm_segment(const shm_segment &) = delete;
+    ~shm_segment();
+
+    /* Private mapping of size bytes, zero filled */
+    bool map_private(size_t size);
+    /* Create the named object with size bytes if it does not exist yet
+     * (is_creator() is then true), otherwise attach to it with whatever
+     * size its creator gave it. */
+    bool map_shared(const std::string &name, size_t size);
+    /* Give the whole pages within off..off+len back to the system, they read
+     * as zeros when touched again. Pages are only backed once written. */
+    void discard(size_t off, size_t len);
+    void unlink();
+
+    void *get() const { return this->addr; }
+    size_t get_size() const { return this->size; }
+    bool is_shared() const { return !this->name.empty(); }
+    bool is_creator() const { return this->created; }
+    const std::string &get_name() const { return this->name; }
+};
@@ -0,0 +1,98 @@
+#include "spill.hpp"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+spill_file::spill_file(const std::string &path, long buf_size, long nslots)
+    : path(path), buf_size(buf_size), nslots(nslots), entries(nslots) {
+    assert(nslots > 0);
+    size_t size = buf_size * nslots;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    int err = fd < 0 ? errno : posix_fallocate(fd, 0, size);
+    if (!err) {
+        void *addr =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            err = errno;
+        else
+            this->base = (char *)addr;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (err) {
+        this->error = path + ": " + strerror(err);
+        unlink(path.c_str());
+    }
+}
+
+spill_file::~spill_file() {
+    if (this->base) {
+        munmap(this->base, this->buf_size * this->nslots);
+        unlink(this->path.c_str());
+    }
+}
+
+bool spill_file::spill(int capuch, int batch_id, const char *buf, long used,
+                       bool charged, sim_clock::time_point now) {
+    assert(used >= 0 && used <= this->buf_size);
+    std::unique_lock<std::mutex> lk(this->guard);
+    if (!this->base || this->head - this->tail == this->nslots) {
+        this->stats.full++;
+        return false;
+    }
+    memcpy(this->slot(this->head), buf, used);
+    this->entries[this->head % this->nslots] = {capuch, batch_id, used,
+                                                charged, now};
+    this->head++;
+    this->pending.store(this->head - this->tail);
+    this->stats.spilled++;
+    this->stats.spilled_bytes += used;
+    return true;
+}
+
+void spill_file::drain(bool clear, const submit_fn &submit) {
+    std::unique_lock<std::mutex> lk(this->guard, std::try_to_lock);
+    if (!lk)
+        return;
+
+    if (this->draining) {
+        if (!this->job.submitted())
+            return;
+        auto finish = this->job.finish.load();
+        for (long i = 0; i < this->draining; ++i) {
+            auto &e = this->entries[(this->tail + i) % this->nslots];
+            this->drain_latency.observe(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(finish -
+                                                                     e.at)
+                    .count());
+        }
+        this->tail += this->draining;
+        this->stats.drained += this->draining;
+        this->pending.store(this->head - this->tail);
+        this->draining = 0;
+    }
+
+    if (!clear || this->head == this->tail)
+        return;
+
+    auto &first = this->entries[this->tail % this->nslots];
+    this->job.reset();
+    this->job.buf_size = this->buf_size;
+    this->job.capuch = first.capuch;
+    this->job.batch_id = first.batch_id;
+    for (long i = this->tail; i < this->head; ++i) {
+        auto &e = this->entries[i % this->nslots];
+        if (e.capuch != first.capuch || e.batch_id != first.batch_id)
+            break;
+        this->job.bufs.push_back({this->slot(i), e.used});
+        if (!e.charged)
+            this->job.bytes += e.used;
+    }
+    this->draining = this->job.bufs.size();
+    submit(&this->job);
+}
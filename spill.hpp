@@ -0,0 +1,78 @@
+#pragma once
+
+#include "clock.hpp"
+#include "flush.hpp"
+#include "metrics.hpp"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Overflow tier: a ring of buffer sized slots in a preallocated, memory
+ * mapped file. When a capuch runs out of buffers, the oldest ready buffer is
+ * copied here instead of being overwritten, and drained to the disk later, in
+ * batches, once its backlog clears. Costs page cache instead of data. */
+class spill_file {
+  public:
+    typedef std::function<void(flush_job *job)> submit_fn;
+
+    struct {
+        std::atomic_ulong spilled = 0; /* Buffers */
+        std::atomic_ulong spilled_bytes = 0;
+        std::atomic_ulong drained = 0; /* Buffers */
+        std::atomic_ulong full = 0;    /* Refused, the ring was full */
+    } stats;
+    histogram drain_latency; /* From spill to the disk accepting it */
+
+  private:
+    struct entry {
+        int capuch;
+        int batch_id;
+        long used;
+        bool charged; /* The disk was charged for it, draining is free */
+        sim_clock::time_point at;
+    };
+
+    std::string path;
+    long buf_size;
+    long nslots;
+    char *base = nullptr;
+    std::string error;
+
+    std::mutex guard;
+    std::vector<entry> entries;
+    long head = 0;     /* Next slot to spill to */
+    long tail = 0;     /* Oldest spilled slot */
+    long draining = 0; /* Slots from tail in the drain job */
+    flush_job job;
+    std::atomic_long pending = 0; /* head - tail, readable without guard */
+
+    char *slot(long i) {
+        return this->base + i % this->nslots * this->buf_size;
+    }
+
+  public:
+    spill_file(const std::string &path, long buf_size, long nslots);
+    spill_file(const spill_file &) = delete;
+    ~spill_file();
+
+    /* Copy the used bytes of buf to the ring, false if full (or no file).
+     * charged if its batch already went to the disk, which then charges
+     * nothing more for it when drained. */
+    bool spill(int capuch, int batch_id, const char *buf, long used,
+               bool charged, sim_clock::time_point now);
+
+    /* Retire a finished drain job, then, if clear, submit the next batch:
+     * consecutive slots of one capuch batch, its bytes what the disk has not
+     * been charged for yet. Never blocks, somebody else is draining if the
+     * guard is taken. */
+    void drain(bool clear, const submit_fn &submit);
+
+    bool is_open() const { return this->base; }
+    const std::string &get_error() const { return this->error; }
+    const std::string &get_path() const { return this->path; }
+    long get_pending() const { return this->pending.load(); }
+    long get_nslots() const { return this->nslots; }
+};